@@ -24,6 +24,7 @@
 #include "fastlz.h"
 
 #include <stdint.h>
+#include <string.h>
 
 /*
  * Always check for bound when decompressing.
@@ -52,6 +53,22 @@
 #define FLZ_ARCH64
 #endif
 
+/*
+ * Use SSE2 (always available on x86-64), or AVX2 when the compiler targets it,
+ * for match extension and literal copy. Define FASTLZ_NO_SIMD to disable.
+ */
+#if defined(FLZ_ARCH64) && !defined(FASTLZ_NO_SIMD)
+#define FLZ_SSE2
+#include <emmintrin.h>
+#if defined(__AVX2__)
+#define FLZ_AVX2
+#include <immintrin.h>
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
 #if defined(FASTLZ_SAFE)
 #define FASTLZ_BOUND_CHECK(cond) \
   if (FASTLZ_UNLIKELY(!(cond))) return 0;
@@ -112,6 +129,21 @@ static uint32_t flz_readu32(const void* ptr) { return *(const uint32_t*)ptr; }
 
 static uint64_t flz_readu64(const void* ptr) { return *(const uint64_t*)ptr; }
 
+#if defined(FLZ_SSE2)
+
+/* index of the lowest set bit (v != 0) */
+static uint32_t flz_ctz(uint32_t v) {
+#if defined(_MSC_VER)
+  unsigned long index;
+  _BitScanForward(&index, v);
+  return index;
+#else
+  return __builtin_ctz(v);
+#endif
+}
+
+#endif /* FLZ_SSE2 */
+
 static uint32_t flz_cmp(const uint8_t* p, const uint8_t* q, const uint8_t* r) {
   const uint8_t* start = p;
 
@@ -123,11 +155,63 @@ static uint32_t flz_cmp(const uint8_t* p, const uint8_t* q, const uint8_t* r) {
     p += 4;
     q += 4;
   }
+  /* same result as the byte loop below (which counts the mismatching byte),
+     never reading beyond r */
+#if defined(FLZ_AVX2)
+  while (q + 32 <= r) {
+    __m256i a = _mm256_loadu_si256((const __m256i*)p);
+    __m256i b = _mm256_loadu_si256((const __m256i*)q);
+    uint32_t mask = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+    if (mask != 0) return p - start + flz_ctz(mask) + 1;
+    p += 32;
+    q += 32;
+  }
+#endif
+#if defined(FLZ_SSE2)
+  while (q + 16 <= r) {
+    __m128i a = _mm_loadu_si128((const __m128i*)p);
+    __m128i b = _mm_loadu_si128((const __m128i*)q);
+    uint32_t mask = ~(uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) & 0xffff;
+    if (mask != 0) return p - start + flz_ctz(mask) + 1;
+    p += 16;
+    q += 16;
+  }
+#endif
   while (q < r)
     if (*p++ != *q++) break;
   return p - start;
 }
 
+#if defined(FLZ_SSE2)
+
+static void flz_copy128(void* dest, const void* src) {
+  _mm_storeu_si128((__m128i*)dest, _mm_loadu_si128((const __m128i*)src));
+}
+
+static void flz_copy256(void* dest, const void* src) {
+#if defined(FLZ_AVX2)
+  _mm256_storeu_si256((__m256i*)dest, _mm256_loadu_si256((const __m256i*)src));
+#else
+  flz_copy128(dest, src);
+  flz_copy128((uint8_t*)dest + 16, (const uint8_t*)src + 16);
+#endif
+}
+
+/* same bytes read and written as the scalar version */
+static void flz_copy64(uint8_t* dest, const uint8_t* src, uint32_t count) {
+  if (count < 16) {
+    if (count >= 8) {
+      flz_copy128(dest, src);
+    } else {
+      *(uint64_t*)dest = *(const uint64_t*)src;
+    }
+  } else {
+    flz_copy256(dest, src);
+  }
+}
+
+#else
+
 static void flz_copy64(uint8_t* dest, const uint8_t* src, uint32_t count) {
   const uint64_t* p = (const uint64_t*)src;
   uint64_t* q = (uint64_t*)dest;
@@ -153,6 +237,8 @@ static void flz_copy256(void* dest, const void* src) {
   *q++ = *p++;
 }
 
+#endif /* FLZ_SSE2 */
+
 #endif /* FLZ_ARCH64 */
 
 #if !defined(FLZ_ARCH64)
@@ -189,6 +275,53 @@ static void flz_copy256(void* dest, const void* src) {
 
 #endif /* !FLZ_ARCH64 */
 
+#if defined(__GNUC__) || defined(__clang__)
+#define FLZ_INLINE static inline __attribute__((always_inline))
+#elif defined(_MSC_VER)
+#define FLZ_INLINE static __forceinline
+#else
+#define FLZ_INLINE static
+#endif
+
+/*
+ * Variants of the hot loops for wider instruction sets, built with target
+ * attributes, and selected at run time by the caller (FASTLZ_HAVE_VARIANTS).
+ */
+#if defined(FASTLZ_HAVE_VARIANTS)
+
+#include <immintrin.h>
+
+#define FLZ_TARGET_AVX2 __attribute__((target("avx2,bmi,bmi2")))
+
+FLZ_TARGET_AVX2 static uint32_t flz_cmp_avx2(const uint8_t* p, const uint8_t* q, const uint8_t* r) {
+  const uint8_t* start = p;
+
+  if (flz_readu64(p) == flz_readu64(q)) {
+    p += 8;
+    q += 8;
+  }
+  if (flz_readu32(p) == flz_readu32(q)) {
+    p += 4;
+    q += 4;
+  }
+  while (q + 32 <= r) {
+    __m256i a = _mm256_loadu_si256((const __m256i*)p);
+    __m256i b = _mm256_loadu_si256((const __m256i*)q);
+    uint32_t mask = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+    if (mask != 0) return p - start + __builtin_ctz(mask) + 1;
+    p += 32;
+    q += 32;
+  }
+  while (q < r)
+    if (*p++ != *q++) break;
+  return p - start;
+}
+
+#endif /* FASTLZ_HAVE_VARIANTS */
+
+/* match length function, resolved at compile time once inlined */
+typedef uint32_t (*flz_cmp_fn)(const uint8_t* p, const uint8_t* q, const uint8_t* r);
+
 #define MAX_COPY 32
 #define MAX_LEN 264 /* 256 + 8 */
 #define MAX_L1_DISTANCE 8192
@@ -204,6 +337,20 @@ static uint16_t flz_hash(uint32_t v) {
   return h & HASH_MASK;
 }
 
+/* hash with a variable table size (1 << log) */
+static uint16_t flz_hash_log(uint32_t v, uint32_t log) {
+  uint32_t h = (v * 2654435769LL) >> (32 - log);
+  return h & ((1 << log) - 1);
+}
+
+/* hash table size (log) suited for a block of "length" bytes (16 entries per
+   byte, so that collisions remain rare) */
+static uint32_t flz_table_log(int length, uint32_t max_log) {
+  uint32_t log = FASTLZ_TABLE_MIN_LOG;
+  while (log < max_log && (1 << (log - 4)) < length) ++log;
+  return log;
+}
+
 static uint8_t* flz_literals(uint32_t runs, const uint8_t* src, uint8_t* dest) {
   while (runs >= MAX_COPY) {
     *dest++ = MAX_COPY - 1;
@@ -273,18 +420,19 @@ static uint8_t* flz1_match(uint32_t len, uint32_t distance, uint8_t* op) {
   return op;
 }
 
-int fastlz1_compress(const void* input, int length, void* output) {
+/*
+  Hash table entries are positions, offset by "base" ; entries below "base"
+  (previous blocks) are too far to be matched.
+*/
+FLZ_INLINE int flz1_compress_table(const void* input, int length, void* output, uint32_t* htab, uint32_t base,
+                                   uint32_t log, flz_cmp_fn extend) {
   const uint8_t* ip = (const uint8_t*)input;
   const uint8_t* ip_start = ip;
   const uint8_t* ip_bound = ip + length - 4; /* because readU32 */
   const uint8_t* ip_limit = ip + length - 12 - 1;
   uint8_t* op = (uint8_t*)output;
 
-  uint32_t htab[HASH_SIZE];
-  uint32_t seq, hash;
-
-  /* initializes hash table */
-  for (hash = 0; hash < HASH_SIZE; ++hash) htab[hash] = 0;
+  uint32_t seq, hash, cur;
 
   /* we start with literal copy */
   const uint8_t* anchor = ip;
@@ -298,33 +446,34 @@ int fastlz1_compress(const void* input, int length, void* output) {
     /* find potential match */
     do {
       seq = flz_readu32(ip) & 0xffffff;
-      hash = flz_hash(seq);
-      ref = ip_start + htab[hash];
-      htab[hash] = ip - ip_start;
-      distance = ip - ref;
-      cmp = FASTLZ_LIKELY(distance < MAX_L1_DISTANCE) ? flz_readu32(ref) & 0xffffff : 0x1000000;
+      hash = flz_hash_log(seq, log);
+      cur = base + (ip - ip_start);
+      distance = cur - htab[hash];
+      htab[hash] = cur;
+      cmp = FASTLZ_LIKELY(distance < MAX_L1_DISTANCE) ? flz_readu32(ip - distance) & 0xffffff : 0x1000000;
       if (FASTLZ_UNLIKELY(ip >= ip_limit)) break;
       ++ip;
     } while (seq != cmp);
 
     if (FASTLZ_UNLIKELY(ip >= ip_limit)) break;
     --ip;
+    ref = ip - distance;
 
     if (FASTLZ_LIKELY(ip > anchor)) {
       op = flz_literals(ip - anchor, anchor, op);
     }
 
-    uint32_t len = flz_cmp(ref + 3, ip + 3, ip_bound);
+    uint32_t len = extend(ref + 3, ip + 3, ip_bound);
     op = flz1_match(len, distance, op);
 
     /* update the hash at match boundary */
     ip += len;
     seq = flz_readu32(ip);
-    hash = flz_hash(seq & 0xffffff);
-    htab[hash] = ip++ - ip_start;
+    hash = flz_hash_log(seq & 0xffffff, log);
+    htab[hash] = base + (ip++ - ip_start);
     seq >>= 8;
-    hash = flz_hash(seq);
-    htab[hash] = ip++ - ip_start;
+    hash = flz_hash_log(seq, log);
+    htab[hash] = base + (ip++ - ip_start);
 
     anchor = ip;
   }
@@ -335,6 +484,16 @@ int fastlz1_compress(const void* input, int length, void* output) {
   return op - (uint8_t*)output;
 }
 
+int fastlz1_compress(const void* input, int length, void* output) {
+  uint32_t htab[HASH_SIZE];
+  uint32_t hash;
+
+  /* initializes hash table */
+  for (hash = 0; hash < HASH_SIZE; ++hash) htab[hash] = 0;
+
+  return flz1_compress_table(input, length, output, htab, 0, HASH_LOG, flz_cmp);
+}
+
 int fastlz1_decompress(const void* input, int length, void* output, int maxout) {
   const uint8_t* ip = (const uint8_t*)input;
   const uint8_t* ip_limit = ip + length;
@@ -407,18 +566,15 @@ static uint8_t* flz2_match(uint32_t len, uint32_t distance, uint8_t* op) {
   return op;
 }
 
-int fastlz2_compress(const void* input, int length, void* output) {
+FLZ_INLINE int flz2_compress_table(const void* input, int length, void* output, uint32_t* htab, uint32_t base,
+                                   uint32_t log, flz_cmp_fn extend) {
   const uint8_t* ip = (const uint8_t*)input;
   const uint8_t* ip_start = ip;
   const uint8_t* ip_bound = ip + length - 4; /* because readU32 */
   const uint8_t* ip_limit = ip + length - 12 - 1;
   uint8_t* op = (uint8_t*)output;
 
-  uint32_t htab[HASH_SIZE];
-  uint32_t seq, hash;
-
-  /* initializes hash table */
-  for (hash = 0; hash < HASH_SIZE; ++hash) htab[hash] = 0;
+  uint32_t seq, hash, cur;
 
   /* we start with literal copy */
   const uint8_t* anchor = ip;
@@ -432,11 +588,11 @@ int fastlz2_compress(const void* input, int length, void* output) {
     /* find potential match */
     do {
       seq = flz_readu32(ip) & 0xffffff;
-      hash = flz_hash(seq);
-      ref = ip_start + htab[hash];
-      htab[hash] = ip - ip_start;
-      distance = ip - ref;
-      cmp = FASTLZ_LIKELY(distance < MAX_FARDISTANCE) ? flz_readu32(ref) & 0xffffff : 0x1000000;
+      hash = flz_hash_log(seq, log);
+      cur = base + (ip - ip_start);
+      distance = cur - htab[hash];
+      htab[hash] = cur;
+      cmp = FASTLZ_LIKELY(distance < MAX_FARDISTANCE) ? flz_readu32(ip - distance) & 0xffffff : 0x1000000;
       if (FASTLZ_UNLIKELY(ip >= ip_limit)) break;
       ++ip;
     } while (seq != cmp);
@@ -444,6 +600,7 @@ int fastlz2_compress(const void* input, int length, void* output) {
     if (FASTLZ_UNLIKELY(ip >= ip_limit)) break;
 
     --ip;
+    ref = ip - distance;
 
     /* far, needs at least 5-byte match */
     if (distance >= MAX_L2_DISTANCE) {
@@ -457,17 +614,17 @@ int fastlz2_compress(const void* input, int length, void* output) {
       op = flz_literals(ip - anchor, anchor, op);
     }
 
-    uint32_t len = flz_cmp(ref + 3, ip + 3, ip_bound);
+    uint32_t len = extend(ref + 3, ip + 3, ip_bound);
     op = flz2_match(len, distance, op);
 
     /* update the hash at match boundary */
     ip += len;
     seq = flz_readu32(ip);
-    hash = flz_hash(seq & 0xffffff);
-    htab[hash] = ip++ - ip_start;
+    hash = flz_hash_log(seq & 0xffffff, log);
+    htab[hash] = base + (ip++ - ip_start);
     seq >>= 8;
-    hash = flz_hash(seq);
-    htab[hash] = ip++ - ip_start;
+    hash = flz_hash_log(seq, log);
+    htab[hash] = base + (ip++ - ip_start);
 
     anchor = ip;
   }
@@ -481,6 +638,16 @@ int fastlz2_compress(const void* input, int length, void* output) {
   return op - (uint8_t*)output;
 }
 
+int fastlz2_compress(const void* input, int length, void* output) {
+  uint32_t htab[HASH_SIZE];
+  uint32_t hash;
+
+  /* initializes hash table */
+  for (hash = 0; hash < HASH_SIZE; ++hash) htab[hash] = 0;
+
+  return flz2_compress_table(input, length, output, htab, 0, HASH_LOG, flz_cmp);
+}
+
 int fastlz2_decompress(const void* input, int length, void* output, int maxout) {
   const uint8_t* ip = (const uint8_t*)input;
   const uint8_t* ip_limit = ip + length;
@@ -501,6 +668,7 @@ int fastlz2_decompress(const void* input, int length, void* output, int maxout)
           code = *ip++;
           len += code;
         } while (code == 255);
+      FASTLZ_BOUND_CHECK(ip < ip_limit);
       code = *ip++;
       ref -= code;
       len += 3;
@@ -559,3 +727,212 @@ int fastlz_compress_level(int level, const void* input, int length, void* output
 
   return 0;
 }
+
+void fastlz_table_init(fastlz_table* table, void* memory, int log) {
+  table->htab = memory;
+  table->log = log;
+  table->base = 0;
+  memset(memory, 0, FASTLZ_TABLE_BYTES(log));
+}
+
+FLZ_INLINE int flz_compress_table(fastlz_table* table, int level, const void* input, int length, void* output,
+                                  flz_cmp_fn extend) {
+  uint32_t* htab = (uint32_t*)table->htab;
+  uint32_t log = flz_table_log(length, table->log);
+  uint32_t base = table->base;
+  int done;
+
+  /* positions of this block must be above the previous ones, and far enough
+     so that they are never reachable: rebase, or restart with a clean table
+     when positions would wrap */
+  if (base > 0xffffffffu - (uint32_t)length - MAX_FARDISTANCE - 1) {
+    memset(htab, 0, FASTLZ_TABLE_BYTES(table->log));
+    base = 0;
+  }
+
+  if (level == 1)
+    done = flz1_compress_table(input, length, output, htab, base, log, extend);
+  else if (level == 2)
+    done = flz2_compress_table(input, length, output, htab, base, log, extend);
+  else
+    done = 0;
+
+  table->base = base + (uint32_t)length + MAX_FARDISTANCE + 1;
+  return done;
+}
+
+int fastlz_compress_table(fastlz_table* table, int level, const void* input, int length, void* output) {
+  return flz_compress_table(table, level, input, length, output, flz_cmp);
+}
+
+#if defined(FASTLZ_HAVE_VARIANTS)
+
+FLZ_TARGET_AVX2 int fastlz_compress_table_avx2(fastlz_table* table, int level, const void* input, int length,
+                                               void* output) {
+  return flz_compress_table(table, level, input, length, output, flz_cmp_avx2);
+}
+
+#endif
+
+/* advance for a 16-byte pattern of period "distance" (multiple of distance) */
+static const uint8_t flz_pattern_step[16] = {0, 16, 16, 15, 16, 15, 12, 14, 16, 9, 10, 11, 12, 13, 14, 15};
+
+/* copy a match, writing up to 31 bytes past op + len */
+FLZ_INLINE uint8_t* flz_wildcopy_match(uint8_t* op, const uint8_t* ref, uint32_t len) {
+  uint8_t* const end = op + len;
+  const uint32_t distance = op - ref;
+
+  if (distance >= 32) {
+    do {
+      memcpy(op, ref, 32);
+      op += 32;
+      ref += 32;
+    } while (op < end);
+  } else if (distance >= 16) {
+    do {
+      memcpy(op, ref, 16);
+      op += 16;
+      ref += 16;
+    } while (op < end);
+  } else if (distance == 1) {
+    /* run of a single byte */
+    memset(op, *ref, len);
+  } else {
+    /* short overlapping match: replicate the pattern, and write it at
+       multiples of its period */
+    uint8_t pattern[32];
+    const uint32_t step = flz_pattern_step[distance];
+    uint32_t n;
+    memcpy(pattern, ref, distance);
+    for (n = distance; n < 16; n += n) memcpy(pattern + n, pattern, n);
+    do {
+      memcpy(op, pattern, 16);
+      op += step;
+    } while (op < end);
+  }
+  return end;
+}
+
+/* copy a literal run (at most MAX_COPY bytes), writing up to 31 bytes past
+   op + count */
+FLZ_INLINE uint8_t* flz_wildcopy_literals(uint8_t* op, const uint8_t* ip, const uint8_t* ip_limit, uint32_t count) {
+  if (FASTLZ_LIKELY(ip + MAX_COPY <= ip_limit)) {
+    memcpy(op, ip, MAX_COPY);
+  } else {
+    fastlz_memcpy(op, ip, count);
+  }
+  return op + count;
+}
+
+FLZ_INLINE int flz1_decompress_fast(const void* input, int length, void* output, int maxout) {
+  const uint8_t* ip = (const uint8_t*)input;
+  const uint8_t* ip_limit = ip + length;
+  const uint8_t* ip_bound = ip_limit - 2;
+  uint8_t* op = (uint8_t*)output;
+  uint8_t* op_limit = op + maxout;
+  uint32_t ctrl = (*ip++) & 31;
+
+  while (1) {
+    if (ctrl >= 32) {
+      uint32_t len = (ctrl >> 5) - 1;
+      uint32_t ofs = (ctrl & 31) << 8;
+      const uint8_t* ref = op - ofs - 1;
+      if (len == 7 - 1) {
+        FASTLZ_BOUND_CHECK(ip <= ip_bound);
+        len += *ip++;
+      }
+      ref -= *ip++;
+      len += 3;
+      FASTLZ_BOUND_CHECK(op + len <= op_limit);
+      FASTLZ_BOUND_CHECK(ref >= (uint8_t*)output);
+      op = flz_wildcopy_match(op, ref, len);
+    } else {
+      ctrl++;
+      FASTLZ_BOUND_CHECK(op + ctrl <= op_limit);
+      FASTLZ_BOUND_CHECK(ip + ctrl <= ip_limit);
+      op = flz_wildcopy_literals(op, ip, ip_limit, ctrl);
+      ip += ctrl;
+    }
+
+    if (FASTLZ_UNLIKELY(ip > ip_bound)) break;
+    ctrl = *ip++;
+  }
+
+  return op - (uint8_t*)output;
+}
+
+FLZ_INLINE int flz2_decompress_fast(const void* input, int length, void* output, int maxout) {
+  const uint8_t* ip = (const uint8_t*)input;
+  const uint8_t* ip_limit = ip + length;
+  const uint8_t* ip_bound = ip_limit - 2;
+  uint8_t* op = (uint8_t*)output;
+  uint8_t* op_limit = op + maxout;
+  uint32_t ctrl = (*ip++) & 31;
+
+  while (1) {
+    if (ctrl >= 32) {
+      uint32_t len = (ctrl >> 5) - 1;
+      uint32_t ofs = (ctrl & 31) << 8;
+      const uint8_t* ref = op - ofs - 1;
+
+      uint8_t code;
+      if (len == 7 - 1) do {
+          FASTLZ_BOUND_CHECK(ip <= ip_bound);
+          code = *ip++;
+          len += code;
+        } while (code == 255);
+      FASTLZ_BOUND_CHECK(ip < ip_limit);
+      code = *ip++;
+      ref -= code;
+      len += 3;
+
+      /* match from 16-bit distance */
+      if (FASTLZ_UNLIKELY(code == 255))
+        if (FASTLZ_LIKELY(ofs == (31 << 8))) {
+          FASTLZ_BOUND_CHECK(ip < ip_bound);
+          ofs = (*ip++) << 8;
+          ofs += *ip++;
+          ref = op - ofs - MAX_L2_DISTANCE - 1;
+        }
+
+      FASTLZ_BOUND_CHECK(op + len <= op_limit);
+      FASTLZ_BOUND_CHECK(ref >= (uint8_t*)output);
+      op = flz_wildcopy_match(op, ref, len);
+    } else {
+      ctrl++;
+      FASTLZ_BOUND_CHECK(op + ctrl <= op_limit);
+      FASTLZ_BOUND_CHECK(ip + ctrl <= ip_limit);
+      op = flz_wildcopy_literals(op, ip, ip_limit, ctrl);
+      ip += ctrl;
+    }
+
+    if (FASTLZ_UNLIKELY(ip >= ip_limit)) break;
+    ctrl = *ip++;
+  }
+
+  return op - (uint8_t*)output;
+}
+
+FLZ_INLINE int flz_decompress_fast(const void* input, int length, void* output, int maxout) {
+  /* magic identifier for compression level */
+  int level = ((*(const uint8_t*)input) >> 5) + 1;
+
+  if (level == 1) return flz1_decompress_fast(input, length, output, maxout);
+  if (level == 2) return flz2_decompress_fast(input, length, output, maxout);
+
+  /* unknown level, trigger error */
+  return 0;
+}
+
+int fastlz_decompress_fast(const void* input, int length, void* output, int maxout) {
+  return flz_decompress_fast(input, length, output, maxout);
+}
+
+#if defined(FASTLZ_HAVE_VARIANTS)
+
+/* same code, with 32-byte copies */
+FLZ_TARGET_AVX2 int fastlz_decompress_fast_avx2(const void* input, int length, void* output, int maxout) {
+  return flz_decompress_fast(input, length, output, maxout);
+}
+
+#endif
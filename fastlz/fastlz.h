@@ -60,6 +60,15 @@ extern "C" {
 
 int fastlz_compress_level(int level, const void* input, int length, void* output);
 
+/**
+  Upper bound of the compressed size of a block of length bytes (at least 16),
+  usable as the output buffer size: incompressible data is stored as literal
+  runs of at most 32 bytes preceded by a marker byte, and matches never expand
+  the data.
+*/
+
+#define FASTLZ_COMPRESS_BOUND(length) ((length) + ((length) + 31) / 32)
+
 /**
   Decompress a block of compressed data and returns the size of the
   decompressed block. If error occurs, e.g. the compressed data is
@@ -78,6 +87,68 @@ int fastlz_compress_level(int level, const void* input, int length, void* output
 
 int fastlz_decompress(const void* input, int length, void* output, int maxout);
 
+/**
+  Hash table owned by the caller, for fastlz_compress_table below. The table
+  memory is FASTLZ_TABLE_BYTES(log) bytes, log being within the
+  [FASTLZ_TABLE_MIN_LOG .. FASTLZ_TABLE_MAX_LOG] range.
+*/
+
+#define FASTLZ_TABLE_MIN_LOG 8
+#define FASTLZ_TABLE_MAX_LOG 14
+#define FASTLZ_TABLE_BYTES(log) (4 << (log))
+
+typedef struct fastlz_table {
+  void* htab;
+  unsigned int log;
+  unsigned int base;
+} fastlz_table;
+
+/**
+  Initialize a hash table, using the caller-provided memory (which is zeroed
+  once).
+*/
+
+void fastlz_table_init(fastlz_table* table, void* memory, int log);
+
+/**
+  Same as fastlz_compress_level above, but using a hash table owned by the
+  caller rather than a table on the stack. The table is not cleared between
+  blocks (positions of previous blocks are ignored), which makes compressing
+  small blocks much cheaper. Only the part of the table suited for the input
+  length is used (16 entries per input byte, up to the table size). With a
+  table of FASTLZ_TABLE_MAX_LOG, the output is nearly identical to the one of
+  fastlz_compress_level.
+*/
+
+int fastlz_compress_table(fastlz_table* table, int level, const void* input, int length, void* output);
+
+/**
+  Same as fastlz_decompress above, but faster: matches and literals are copied
+  by wide chunks, which may write up to FASTLZ_DECOMPRESS_SLACK bytes past
+  maxout. The output buffer must therefore be at least
+  maxout + FASTLZ_DECOMPRESS_SLACK bytes. Bound checks are the same.
+*/
+
+#define FASTLZ_DECOMPRESS_SLACK 32
+
+int fastlz_decompress_fast(const void* input, int length, void* output, int maxout);
+
+/**
+  Variants of fastlz_compress_table and fastlz_decompress_fast for wider
+  instruction sets (AVX2 with BMI2), producing the same output. They
+  are only built on x86-64 with GCC or clang (when not targeting AVX2 already),
+  and the caller must check that the CPU supports them.
+*/
+
+#if (defined(__x86_64__) || defined(_M_X64)) && (defined(__GNUC__) || defined(__clang__)) && \
+    !defined(__AVX2__) && !defined(FASTLZ_NO_SIMD)
+#define FASTLZ_HAVE_VARIANTS
+
+int fastlz_compress_table_avx2(fastlz_table* table, int level, const void* input, int length, void* output);
+
+int fastlz_decompress_fast_avx2(const void* input, int length, void* output, int maxout);
+#endif
+
 /**
   DEPRECATED.
 
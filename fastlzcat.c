@@ -36,18 +36,33 @@
 
 static void usage(char *arg0) {
   fprintf(stderr,
-          "%s, FastLZ compression/decompression tool.\n"
+          "%s, FastLZ compression/decompression tool (%s kernels).\n"
           "Usage: %s (filename|-) (filename ..)\t#input filename(s) or stdin\n"
           "\t[--output (filename|-)]\t#output filename or stdout\n"
           "\t[--compress|--decompress]\t#mode\n"
-          "\t[--lz4|--fastlz]\t#compression type\n"
-          "\t[--fast|--normal]\t#compression speed\n"
+          "\t[--lz4|--fastlz|--auto]\t#compression type\n"
+          "\t[--minspeed n]\t#minimum speed (MB/s) of --auto (0)\n"
+          "\t[--fast|--normal|--best]\t#compression speed\n"
+          "\t[--level n|-0 .. -9]\t#compression level (%d .. 9)\n"
           "\t[--inbufsize n]\t#input buffer size (262144)\n"
           "\t[--outbufsize n]\t#output buffer size (1048576)\n"
           "\t[--blocksize n]\t#block stream size (1048576)\n"
           "\t[--flush]\t#flush uncompressed data regularly\n"
+          "\t[--tagged]\t#tag blocks with their compressor\n"
+          "\t[--linked]\t#link LZ4 blocks (better ratio for small blocks)\n"
+          "\t[--keyframe n]\t#independent block every n linked blocks (64)\n"
+          "\t[--mingain n]\t#minimum gain (%%) of compressed blocks (0)\n"
+          "\t[--backoff n]\t#blocks stored raw after repeated failures (0)\n"
+          "\t[--page n]\t#emit pages of exactly n bytes (--lz4)\n"
+          "\t[--hugepages]\t#back large buffers with huge pages\n"
+          "\t[--checksum]\t#add block and content checksums\n"
+          "\t[--noverify]\t#do not verify checksums\n"
+          "\t[--index]\t#append a seek index\n"
+          "\t[--dict filename]\t#LZ4 preset dictionary\n"
+          "\t[--train]\t#train a dictionary from the input files\n"
+          "\t[--dictsize n]\t#trained dictionary size (65536)\n"
           ,
-          arg0, arg0);
+          arg0, fastlzlibVariant(), arg0, ZFAST_LEVEL_FASTEST);
 }
 
 static void error(const char *msg) {
@@ -66,13 +81,57 @@ static void flzerror(zfast_stream *s, const char *msg) {
   exit(EXIT_FAILURE);
 }
 
+/* read a whole file ("-" for stdin) */
+static Bytef* readfile(const char *filename, uInt *psize) {
+  const int is_stdin = strcmp(filename, "-") == 0;
+  FILE *const fp = is_stdin ? stdin : fopen(filename, "rb");
+  Bytef *data = NULL;
+  uInt size = 0;
+  int n;
+  if (fp == NULL) {
+    syserror("can not open file");
+  }
+  do {
+    data = realloc(data, size + 65536);
+    if (data == NULL) {
+      error("memory exhausted");
+    }
+    n = fread(&data[size], 1, 65536, fp);
+    if (n > 0) {
+      size += n;
+    }
+  } while(n > 0);
+  if (ferror(fp)) {
+    syserror("can not read file");
+  }
+  if (!is_stdin) {
+    fclose(fp);
+  }
+  *psize = size;
+  return data;
+}
+
 int main(int argc, char **argv) {
   int *files = malloc(sizeof(int) * argc);
   int nfiles = 0;
   const char *output = NULL;
+  const char *dict = NULL;
   int compress = 0;
   int list = 0;
   int flush = 0;
+  int linked = 0;
+  int tagged = 0;
+  int keyframe = -1;
+  int min_gain = 0;
+  int min_speed = 0;
+  int backoff = 0;
+  int page = 0;
+  int train = 0;
+  int hugepages = 0;
+  int checksums = 0;
+  int verify = 1;
+  int index = 0;
+  uInt dict_size = 65536;
   zfast_stream_compressor type = COMPRESSOR_FASTLZ;
   int perfs = 2;
   uInt block_size = 262144;
@@ -97,18 +156,84 @@ int main(int argc, char **argv) {
     else if (strcmp(argv[i], "--flush") == 0) {
       flush = 1;
     }
+    else if (strcmp(argv[i], "--tagged") == 0) {
+      tagged = 1;
+    }
+    else if (strcmp(argv[i], "--linked") == 0) {
+      linked = 1;
+    }
+    else if (strcmp(argv[i], "--hugepages") == 0) {
+      hugepages = 1;
+    }
+    else if (strcmp(argv[i], "--checksum") == 0) {
+      checksums = ZFAST_CHECKSUM_BLOCK | ZFAST_CHECKSUM_CONTENT;
+    }
+    else if (strcmp(argv[i], "--noverify") == 0) {
+      verify = 0;
+    }
+    else if (strcmp(argv[i], "--index") == 0) {
+      index = 1;
+    }
+    else if (i + 1 < argc && strcmp(argv[i], "--keyframe") == 0) {
+      if (sscanf(argv[i + 1], "%d", &keyframe) != 1 || keyframe < 0) {
+        error("invalid keyframe interval");
+      }
+      i++;
+    }
+    else if (i + 1 < argc && strcmp(argv[i], "--mingain") == 0) {
+      if (sscanf(argv[i + 1], "%d", &min_gain) != 1
+          || min_gain < 0 || min_gain > 99) {
+        error("invalid minimum gain");
+      }
+      i++;
+    }
+    else if (i + 1 < argc && strcmp(argv[i], "--backoff") == 0) {
+      if (sscanf(argv[i + 1], "%d", &backoff) != 1 || backoff < 0) {
+        error("invalid backoff");
+      }
+      i++;
+    }
+    else if (i + 1 < argc && strcmp(argv[i], "--page") == 0) {
+      if (sscanf(argv[i + 1], "%d", &page) != 1
+          || page < ZFAST_PAGE_MIN_SIZE) {
+        error("invalid page size");
+      }
+      i++;
+    }
     else if (strcmp(argv[i], "--lz4") == 0) {
       type = COMPRESSOR_LZ4;
     }
     else if (strcmp(argv[i], "--fastlz") == 0) {
       type = COMPRESSOR_FASTLZ;
     }
+    else if (strcmp(argv[i], "--auto") == 0) {
+      type = COMPRESSOR_AUTO;
+    }
+    else if (i + 1 < argc && strcmp(argv[i], "--minspeed") == 0) {
+      if (sscanf(argv[i + 1], "%d", &min_speed) != 1 || min_speed < 0) {
+        error("invalid minimum speed");
+      }
+      i++;
+    }
     else if (strcmp(argv[i], "--fast") == 0) {
       perfs = 1;
     }
     else if (strcmp(argv[i], "--normal") == 0) {
       perfs = 2;
     }
+    else if (strcmp(argv[i], "--best") == 0) {
+      perfs = Z_BEST_COMPRESSION;
+    }
+    else if (i + 1 < argc && strcmp(argv[i], "--level") == 0) {
+      int level;
+      if (sscanf(argv[i + 1], "%d", &level) == 1
+          && level >= ZFAST_LEVEL_FASTEST && level <= Z_BEST_COMPRESSION) {
+        perfs = level;
+      } else {
+        error("invalid level");
+      }
+      i++;
+    }
     else if (i + 1 < argc && strcmp(argv[i], "--inbufsize") == 0) {
       int size;
       if (sscanf(argv[i + 1], "%d", &size) == 1) {
@@ -141,6 +266,22 @@ int main(int argc, char **argv) {
              || strcmp(argv[i], "--to-stdout") == 0) {
       output = "-";
     }
+    else if (strcmp(argv[i], "--train") == 0) {
+      train = 1;
+    }
+    else if (i + 1 < argc && strcmp(argv[i], "--dictsize") == 0) {
+      int size;
+      if (sscanf(argv[i + 1], "%d", &size) == 1 && size > 0) {
+        dict_size = size;
+      } else {
+        error("invalid size");
+      }
+      i++;
+    }
+    else if (i + 1 < argc && strcmp(argv[i], "--dict") == 0) {
+      dict = argv[i + 1];
+      i++;
+    }
     else if (i + 1 < argc && strcmp(argv[i], "--output") == 0) {
       output = argv[i + 1];
       i++;
@@ -152,9 +293,7 @@ int main(int argc, char **argv) {
              && ( argv[i][1] >= '0' && argv[i][1] <= '9' )
              && argv[i][2] == '\0'
              ) {
-      int level = argv[i][1] - '0';
-      perfs = level >= 2 ? 2 : 1;
-      error("invalid option");
+      perfs = argv[i][1] - '0';
     }
     else if (argv[i][0] == '-' && argv[i][1] == '-') {
       error("invalid option");
@@ -164,6 +303,46 @@ int main(int argc, char **argv) {
     }
   }
 
+  /* train a dictionary, using each input file as a sample */
+  if (train && nfiles != 0) {
+    const void **samples = malloc(sizeof(void*) * nfiles);
+    uInt *sizes = malloc(sizeof(uInt) * nfiles);
+    Bytef *data = malloc(dict_size);
+    FILE *outstream;
+    int size;
+    if (samples == NULL || sizes == NULL || data == NULL) {
+      error("memory exhausted");
+    }
+    if (output == NULL) {
+      error("no output dictionary file (--output)");
+    }
+    for(i = 0 ; i < nfiles ; i++) {
+      samples[i] = readfile(argv[files[i]], &sizes[i]);
+    }
+    size = fastlzlibTrainDictionary(samples, sizes, nfiles, data, dict_size);
+    if (size < 0) {
+      error("unable to train the dictionary");
+    }
+    outstream = strcmp(output, "-") == 0 ? stdout : fopen(output, "wb");
+    if (outstream == NULL) {
+      syserror("can not open output file");
+    }
+    if (fwrite(data, 1, size, outstream) != (size_t) size) {
+      syserror("write error");
+    }
+    if (outstream != stdout && fclose(outstream) != 0) {
+      syserror("write error");
+    }
+    for(i = 0 ; i < nfiles ; i++) {
+      free((void*) samples[i]);
+    }
+    free(samples);
+    free(sizes);
+    free(data);
+    free(files);
+    return EXIT_SUCCESS;
+  }
+
   /* list mode: only read headers */
   if (list) {
     inbufsize = fastlzlibGetHeaderSize();
@@ -190,10 +369,43 @@ int main(int argc, char **argv) {
       }
     }
 
+    if (hugepages
+        && fastlzlibSetAllocator(&stream,
+                                 fastlzlibGetHugePageAllocator(1)) != Z_OK) {
+      flzerror(&stream, "unable to set the allocator");
+    }
+
     if (fastlzlibSetCompressor(&stream, type) != Z_OK) {
       flzerror(&stream, "unable to initialize the specified compressor");
     }
 
+    if (fastlzlibSetOption(&stream, OPTION_LINKED_BLOCKS, linked) != Z_OK
+        || fastlzlibSetOption(&stream, OPTION_TAGGED_BLOCKS, tagged) != Z_OK
+        || ( keyframe != -1
+             && fastlzlibSetOption(&stream, OPTION_KEYFRAME_INTERVAL,
+                                   keyframe) != Z_OK )
+        || fastlzlibSetOption(&stream, OPTION_MIN_GAIN, min_gain) != Z_OK
+        || fastlzlibSetOption(&stream, OPTION_MIN_SPEED, min_speed) != Z_OK
+        || fastlzlibSetOption(&stream, OPTION_BACKOFF_BLOCKS, backoff) != Z_OK
+        || ( page != 0
+             && fastlzlibSetOption(&stream, OPTION_PAGE_SIZE, page) != Z_OK )
+        || fastlzlibSetOption(&stream, OPTION_CHECKSUMS, checksums) != Z_OK
+        || fastlzlibSetOption(&stream, OPTION_VERIFY_CHECKSUMS, verify)
+        != Z_OK
+        || fastlzlibSetOption(&stream, OPTION_INDEX, index) != Z_OK
+        ) {
+      flzerror(&stream, "unable to set the stream options");
+    }
+
+    if (dict != NULL) {
+      uInt size;
+      Bytef *const data = readfile(dict, &size);
+      if (fastlzlibSetDictionary(&stream, data, size) != Z_OK) {
+        flzerror(&stream, "unable to set the dictionary");
+      }
+      free(data);
+    }
+
     if (output != NULL) {
       if (strcmp(output, "-") == 0) {
         outstream = stdout;
@@ -214,6 +426,10 @@ int main(int argc, char **argv) {
       const char*const filename = argv[files[i]];
       uLong total_out = 0;
       uLong total_in = 0;
+      /* checksums declared by the stream (list mode) */
+      int flags = 0;
+      /* end of stream reached (only a seek index may follow) */
+      int ended = 0;
      
       if (strcmp(filename, "-") == 0) {
         instream = stdin;
@@ -246,7 +462,7 @@ int main(int argc, char **argv) {
               }
               fprintf(stdout, "%s block at %u ([%u .. %u[):"
                       "\tcompressed=%u\tuncompressed=%u"
-                      "\t[block_size=%u]\n",
+                      "\t[block_size=%u]",
                       compressed_size != uncompressed_size 
                       ? "compressed" : "uncompressed",
                       (int) total_in,
@@ -256,20 +472,54 @@ int main(int argc, char **argv) {
                       (int) uncompressed_size,
                       fastlzlibGetStreamBlockSize(buf, n));
 
-              /* check eof consistency */
-              if (compressed_size == 0 && uncompressed_size == 0) {
-                int n = fread(buf, 1, 1, instream);
-                const int is_eof = feof(instream);
-                if (n != 0 || !is_eof) {
-                  error("premature EOF before end of stream");
+              /* read stream information, the seek index, and blocks holding
+                 a checksum */
+              if (( compressed_size != 0 && uncompressed_size == 0 )
+                  || ( flags & ZFAST_CHECKSUM_BLOCK ) != 0) {
+                const uInt size = n + compressed_size;
+                uInt block_checksum;
+                Bytef content_checksum[8];
+                int found;
+                if (size > outbufsize) {
+                  free(dest);
+                  outbufsize = size;
+                  dest = malloc(outbufsize);
+                  if (dest == NULL) {
+                    error("memory exhausted");
+                  }
+                }
+                memcpy(dest, buf, n);
+                if (fread(&dest[n], 1, compressed_size, instream)
+                    != compressed_size) {
+                  error("premature end of stream");
+                }
+                if (ended) {
+                  const int count = fastlzlibLoadIndex(&stream, dest, size);
+                  if (count < 0) {
+                    error("premature EOF before end of stream");
+                  }
+                  fprintf(stdout, "\tindex=%d", count);
+                  ended = 2;
+                }
+                found = fastlzlibGetBlockChecksums(dest, size, &flags,
+                                                   &block_checksum,
+                                                   content_checksum);
+                if (found < 0) {
+                  error("stream read error");
+                }
+                if (( found & ZFAST_CHECKSUM_BLOCK ) != 0) {
+                  fprintf(stdout, "\tchecksum=%08x", block_checksum);
+                }
+                if (( found & ZFAST_CHECKSUM_CONTENT ) != 0) {
+                  int j;
+                  fprintf(stdout, "\tcontent_checksum=");
+                  for(j = 0 ; j < 8 ; j++) {
+                    fprintf(stdout, "%02x", content_checksum[j]);
+                  }
                 }
               }
-              else if (is_eof) {
-                error("premature end of stream");
-              }
-              
               /* skip compressed data */
-              if (fseek(instream, compressed_size, SEEK_CUR) != 0) {
+              else if (fseek(instream, compressed_size, SEEK_CUR) != 0) {
                 if (errno == EBADF) {
                   /* fseek() on stdin */
                   int skip, n;
@@ -284,6 +534,30 @@ int main(int argc, char **argv) {
                   syserror("seek error");
                 }
               }
+              fprintf(stdout, "\n");
+
+              /* check eof consistency (a seek index may follow the EOF
+                 marker, and must then end the file) */
+              if (ended == 1) {
+                error("premature EOF before end of stream");
+              }
+              if (( compressed_size == 0 && uncompressed_size == 0 )
+                  || ended) {
+                const int c = fgetc(instream);
+                if (c != EOF) {
+                  if (ended) {
+                    error("premature EOF before end of stream");
+                  }
+                  ungetc(c, instream);
+                }
+                if (!ended) {
+                  ended = 1;
+                }
+              }
+              else if (is_eof) {
+                error("premature end of stream");
+              }
+              
               total_in += n + compressed_size;
               total_out += uncompressed_size;
             }
@@ -308,10 +582,18 @@ int main(int argc, char **argv) {
                 }
 
                 if (success == Z_STREAM_END) {
-                  if (stream.avail_in > 0 || !is_eof) {
+                  /* decompressing: a seek index may follow, and is skipped */
+                  if (!compress) {
+                    ended = 1;
+                    success = Z_OK;
+                  }
+                  else if (stream.avail_in > 0 || !is_eof) {
                     error("premature EOF before end of stream");
                   }
                 }
+                else if (success == Z_OK && stream.next_out != dest) {
+                  ended = 0;
+                }
               
                 if (outstream != NULL && stream.next_out != dest) {
                   const size_t len = stream.next_out - dest;
@@ -326,10 +608,13 @@ int main(int argc, char **argv) {
 
               /* Z_BUF_ERROR means that we need to feed more */
               if (success == Z_BUF_ERROR) {
-                if (is_eof && stream.avail_out != 0) {
+                if (is_eof && stream.avail_out != 0 && !ended) {
                   error("premature end of stream");
                 }
               }
+              else if (success == Z_NEED_DICT) {
+                flzerror(&stream, "a dictionary is required (--dict)");
+              }
               else if (success < 0) {
                 flzerror(&stream, "stream error");
               }
@@ -0,0 +1,80 @@
+/*  
+  zlib-like interface to fast block compression (LZ4 or FastLZ) libraries
+  Copyright (C) 2010-2013 Exalead SA. (http://www.exalead.com/)
+  
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+
+  Remarks/Bugs:
+  LZ4 compression library by Yann Collet (yann.collet.73@gmail.com)
+  FastLZ compression library by Ariya Hidayat (ariya@kde.org)
+  Library encapsulation by Xavier Roche (fastlz@exalead.com)
+*/
+
+/* C++17 adapter header file - stream memory from a std::pmr::memory_resource */
+
+#ifndef FASTLZ_FASTLZLIB_PMR_H
+#define FASTLZ_FASTLZLIB_PMR_H
+
+#include <memory_resource>
+#include <new>
+
+#include "fastlzlib.h"
+
+namespace fastlzlib {
+
+/**
+ * Allocator of stream memory taken from the memory resource given as
+ * "opaque" (allocation failures are reported as NULL to the library).
+ **/
+inline void* pmr_allocate(void *opaque, size_t size, size_t alignment,
+                          int /* hint */) {
+  try {
+    return static_cast<std::pmr::memory_resource*>(opaque)
+      ->allocate(size, alignment);
+  } catch (const std::bad_alloc&) {
+    return NULL;
+  }
+}
+
+inline void pmr_deallocate(void *opaque, void *address, size_t size,
+                           size_t alignment) {
+  static_cast<std::pmr::memory_resource*>(opaque)
+    ->deallocate(address, size, alignment);
+}
+
+/**
+ * Return an allocator taking all the stream memory from "resource", which
+ * must outlive the stream.
+ * Example:
+ *   zfast_allocator allocator = fastlzlib::pmr_allocator(&arena);
+ *   fastlzlibCompressInit(&s, level);
+ *   fastlzlibSetAllocator(&s, &allocator);
+ **/
+inline zfast_allocator pmr_allocator(std::pmr::memory_resource *resource
+                                     = std::pmr::get_default_resource()) {
+  zfast_allocator allocator;
+  allocator.allocate = pmr_allocate;
+  allocator.deallocate = pmr_deallocate;
+  allocator.opaque = resource;
+  return allocator;
+}
+
+}
+
+#endif
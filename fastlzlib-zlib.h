@@ -43,20 +43,20 @@
 #define deflateReset fastlzlibCompressReset
 #define inflateSync  fastlzlibDecompressSync
 #define inflateReset fastlzlibDecompressReset
+#define deflateSetDictionary fastlzlibSetDictionary
+#define inflateSetDictionary fastlzlibSetDictionary
+#define deflateBound(S, LEN) fastlzlibCompressBound(S, LEN, Z_FINISH)
 
 /*
   Undefined symbols:
   
   deflateInit2
-  deflateSetDictionary
   deflateCopy
   deflateParams
   deflateTune
-  deflateBound
   deflatePrime
   deflateSetHeader
   inflateInit2
-  inflateSetDictionary
   inflateCopy
   inflatePrime
   inflateGetHeader
@@ -43,15 +43,46 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <stdint.h>
+
+/* threads (dictionary training, stream pools) */
+#if !defined(_WIN32) && !defined(ZFAST_NO_THREADS)
+#include <pthread.h>
+#include <unistd.h>
+#define ZFAST_USE_THREADS
+#endif
+
+/* clock (adaptive compressor) */
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+/* aligned and huge pages allocation (fastlzlibGetHugePageAllocator()), and
+   mapping of compressed files (fastlzlibReaderOpenFd()) */
+#if defined(_WIN32)
+#include <malloc.h>
+#include <io.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 #include "fastlzlib.h"
 
 /* use LZ4 */
 #ifdef ZFAST_USE_LZ4
+#define LZ4_STATIC_LINKING_ONLY
+#define LZ4_HC_STATIC_LINKING_ONLY
 #include "lz4/lz4.h"
 #include "lz4/lz4hc.h"
 #endif
 
+/* xxHash, shipped with LZ4 (dictionary identifiers, checksums) */
+#define XXH_STATIC_LINKING_ONLY
+#include "lz4/xxhash.h"
+
 /* use fastLZ */
 #ifdef ZFAST_USE_FASTLZ
 #include "fastlz/fastlz.h"
@@ -73,6 +104,54 @@
 #define MIN_BLOCK_SIZE          64
 #define DEFAULT_BLOCK_SIZE  262144
 
+/* level used for Z_DEFAULT_COMPRESSION */
+#define DEFAULT_LEVEL            6
+
+/* history window of linked blocks (LZ4 maximum match distance) */
+#define LINKED_WINDOW        65536
+
+/* default number of blocks between two keyframes, for linked blocks */
+#define DEFAULT_KEYFRAME_INTERVAL 64
+
+/* streams kept by each thread of a stream pool */
+#define POOL_CACHE_SIZE          8
+
+/* random-access readers: maximum shards of the decoded blocks cache,
+   default cache size, sequential readers tracked for readahead, and pending
+   readahead requests of all readers */
+#define READER_SHARDS           16
+#define READER_CACHE_SIZE (64 << 20)
+#define READER_STREAMS           8
+#define READER_AHEAD_QUEUE      64
+
+/* alignment of the memory requested to stream allocators (cache line), and
+   huge page size (allocations of at least this size are backed by huge
+   pages with the built-in allocator) */
+#define ALLOC_ALIGNMENT         64
+#define HUGE_PAGE_SIZE     2097152
+
+/* incompressible data detection: minimum block size, sampled runs of bytes,
+   and size of the trial compression slice */
+#define DETECT_MIN_SIZE       1024
+#define DETECT_RUNS             64
+#define DETECT_RUN_SIZE         64
+#define DETECT_TRIAL_SIZE     4096
+
+/* minimum gain (in percent) of the trial slice */
+#define DETECT_TRIAL_GAIN        3
+
+/* consecutive incompressible blocks before backing off */
+#define BACKOFF_FAILURES         2
+
+/* adaptive compressor (COMPRESSOR_AUTO): maximum number of candidates,
+   blocks between two trials, trials skipped by too slow candidates, and
+   size bounds of the trial slice */
+#define AUTO_CANDIDATES          5
+#define AUTO_TRIAL_INTERVAL     16
+#define AUTO_SLOW_SKIPS          8
+#define AUTO_TRIAL_MIN_SIZE   4096
+#define AUTO_TRIAL_MAX_SIZE  16384
+
 /* size of blocks to be compressed */
 #define BLOCK_SIZE(S) ( (S)->state->block_size )
 
@@ -80,17 +159,66 @@
 #define POWER_BASE 10
 #define POWER_TO_BLOCK_SIZE(P) ( 1 << ( P + POWER_BASE ) )
 
-/* estimated upper boundary of compressed size */
-#define BUFFER_BLOCK_SIZE(S)                                            \
-  ( BLOCK_SIZE(S) + BLOCK_SIZE(S) / EXPANSION_RATIO + HEADER_SIZE*2)
+/* decompression output buffer size: a block, and the margin needed to
+   decompress LZ4 blocks in place (LZ4_DECOMPRESS_INPLACE_MARGIN), which also
+   leaves the wide-copy slack of the FastLZ decompressor */
+#define DECOMPRESS_BUFFER_SIZE(S)                               \
+  ( BLOCK_SIZE(S) + ( BLOCK_SIZE(S) >> 8 ) + 32 )
 
 /* block types (base ; the lower four bits are used for block size) */
 #define BLOCK_TYPE_RAW         (0x10)
+#define BLOCK_TYPE_FASTLZ      (0x20)
+#define BLOCK_TYPE_LZ4         (0x30)
+#define BLOCK_TYPE_LZFSE       (0x40)
+#define BLOCK_TYPE_INDEX       (0x50)
 #define BLOCK_TYPE_COMPRESSED  (0xc0)
+#define BLOCK_TYPE_LINKED      (0xd0)
+#define BLOCK_TYPE_KEYFRAME    (0xe0)
+#define BLOCK_TYPE_INFO        (0xf0)
 #define BLOCK_TYPE_BAD_MAGIC   (0xffff)
 
+/* stream information records (tag, length, value) of BLOCK_TYPE_INFO */
+#define INFO_PADDING           (0x00)
+#define INFO_DICTIONARY_ID     (0x01)
+#define INFO_FLAGS             (0x02)
+#define INFO_CONTENT_CHECKSUM  (0x03)
+
+/* XXH32 of the stored data of a block (ZFAST_CHECKSUM_BLOCK), following it
+   and included in the block stored size */
+#define BLOCK_CHECKSUM_SIZE    4
+
+/* stream information block holding the XXH64 of the content
+   (ZFAST_CHECKSUM_CONTENT), preceding the EOF marker */
+#define CONTENT_CHECKSUM_SIZE  (HEADER_SIZE + 2 + 8)
+
+/* seek index (OPTION_INDEX) following the EOF marker, in a BLOCK_TYPE_INDEX
+   block: entries (LE64 compressed offset of the block header, LE64
+   uncompressed offset) of the independent blocks, and the locator footer
+   (LE64 offset of the index block, LE64 uncompressed size, LE32 number of
+   entries, LE32 dictionary identifier, 8-bit flags and three reserved bytes,
+   LE32 XXH32 of the entries and of the previous footer fields, and the
+   INDEX_MAGIC) */
+#define INDEX_ENTRY_SIZE       16
+#define INDEX_FOOTER_SIZE      36
+#define INDEX_TRAILER_SIZE(N)                                           \
+  ( HEADER_SIZE + (N) * INDEX_ENTRY_SIZE + INDEX_FOOTER_SIZE )
+
+/* index footer flags: the stream checksum flags (ZFAST_CHECKSUM_*), and the
+   use of a preset dictionary */
+#define INDEX_FLAG_DICTIONARY  (0x80)
+
+/* maximum size of the stream information block, including its header */
+#define INFO_MAX_SIZE          (HEADER_SIZE + 32)
+
+/* smallest padding block: padding blocks hold at least one record, as an
+   empty block is an EOF marker */
+#define PADDING_MIN_SIZE       (HEADER_SIZE + 2)
+
 /* fake level for decompression */
-#define ZFAST_LEVEL_DECOMPRESS (-2)
+#define ZFAST_LEVEL_DECOMPRESS (ZFAST_LEVEL_FASTEST - 1)
+
+/* fake compressor type for client-defined backends */
+#define ZFAST_COMPRESSOR_CUSTOM (-1)
 
 /* macros */
 
@@ -100,6 +228,33 @@
 /* the stream is used for decompressing */
 #define ZFAST_IS_DECOMPRESSING(S) ( !ZFAST_IS_COMPRESSING(S) )
 
+/* the stream compresses into fixed-size pages (OPTION_PAGE_SIZE) */
+#define ZFAST_IS_PAGED(S)                                       \
+  ( ZFAST_IS_COMPRESSING(S) && (S)->state->page_size != 0 )
+
+/* the compressing stream has input data pending in inBuff (data read for
+   the current block, or left by the previous page) */
+#define ZFAST_HAS_BUFFERED_INPUT(S)                             \
+  ( ZFAST_IS_COMPRESSING(S) && (S)->state->inBuffOffs != 0 )
+
+/* size of the checksum following the stored data of blocks, for the
+   checksum flags "F" */
+#define ZFAST_BLOCK_CHECKSUM_SIZE(F)                                    \
+  ( ( (F) & ZFAST_CHECKSUM_BLOCK ) != 0 ? BLOCK_CHECKSUM_SIZE : 0 )
+
+/* size of the end of a stream (content checksum, and EOF marker), for the
+   checksum flags "F" */
+#define ZFAST_EOF_SIZE(F)                                               \
+  ( HEADER_SIZE                                                         \
+    + ( ( (F) & ZFAST_CHECKSUM_CONTENT ) != 0 ? CONTENT_CHECKSUM_SIZE : 0 ) )
+
+/* input buffer size: a block, and its checksum */
+#define INPUT_BUFFER_SIZE(S) ( BLOCK_SIZE(S) + BLOCK_CHECKSUM_SIZE )
+
+/* "N" bytes can be filled with a padding block */
+#define ZFAST_IS_PADDING_SIZE(N)                                        \
+  ( (N) == 0 || (N) >= PADDING_MIN_SIZE )
+
 /* no input bytes available */
 #define ZFAST_INPUT_IS_EMPTY(S) ( (S)->avail_in == 0 )
 
@@ -110,11 +265,17 @@
 #define ZFAST_HAS_BUFFERED_OUTPUT(S)                    \
   ( s->state->outBuffOffs < s->state->dec_size )
 
+/* where the pending output lies (outBuff, or a stored block being peeked) */
+#define ZFAST_BUFFERED_OUTPUT(S)                                        \
+  ( (S)->state->outView != NULL ? (S)->state->outView : (S)->state->outBuff )
+
 /* compress stream */
-#define ZFAST_COMPRESS s->state->compress
+#define ZFAST_COMPRESS(LEVEL, IN, LEN, OUT, MAXOUT)                     \
+  s->state->compress(s->state->compress_ctx, LEVEL, IN, LEN, OUT, MAXOUT)
 
 /* decompress stream */
-#define ZFAST_DECOMPRESS s->state->decompress
+#define ZFAST_DECOMPRESS(IN, LEN, OUT, MAXOUT)                          \
+  s->state->decompress(s->state->decompress_ctx, IN, LEN, OUT, MAXOUT)
 
 /* inlining */
 #ifndef ZFASTINLINE
@@ -124,7 +285,7 @@
 /* tools */
 #define READ_8(adr)  (*(adr))
 #define READ_16(adr) ( READ_8(adr) | (READ_8((adr)+1) << 8) )
-#define READ_32(adr) ( READ_16(adr) | (READ_16((adr)+2) << 16) )
+#define READ_32(adr) ( (uInt) READ_16(adr) | ((uInt) READ_16((adr)+2) << 16) )
 #define WRITE_8(buff, n) do {                          \
     *((buff))     = (unsigned char) ((n) & 0xff);      \
   } while(0)
@@ -136,6 +297,12 @@
     WRITE_16((buff), (n) & 0xffff);             \
     WRITE_16((buff) + 2, (n) >> 16);            \
   } while(0)
+#define READ_64(adr) ( (uint64_t) READ_32(adr)                  \
+                       | ( (uint64_t) READ_32((adr)+4) << 32 ) )
+#define WRITE_64(buff, n) do {                          \
+    WRITE_32((buff), (uInt) ( (n) & 0xffffffff ));      \
+    WRITE_32((buff) + 4, (uInt) ( (n) >> 32 ));         \
+  } while(0)
 
 /* magic for opaque "state" structure */
 static const char MAGIC[8] = {'F', 'a', 's', 't', 'L', 'Z', 0x01, 0};
@@ -143,6 +310,70 @@ static const char MAGIC[8] = {'F', 'a', 's', 't', 'L', 'Z', 0x01, 0};
 /* magic for stream (7 bytes with terminating \0) */
 static const char* BLOCK_MAGIC = "FastLZ";
 
+/* magic ending the seek index footer */
+static const char INDEX_MAGIC[4] = {'F', 'L', 'Z', 'I'};
+
+/* digested preset dictionary, shareable between streams */
+struct zfast_dictionary {
+  /* dictionary identifier (XXH32 of the whole dictionary) */
+  uInt id;
+  /* last LINKED_WINDOW bytes (at most) of the dictionary */
+  Bytef *data;
+  uInt size;
+  /* LZ4 fast compression digest (LZ4_stream_t) */
+  void *lz4;
+  /* LZ4 high compression digest (LZ4_streamHC_t), if any */
+  void *lz4hc;
+};
+
+/* candidate of the adaptive compressor, and its running estimations */
+typedef struct zfast_auto_candidate {
+  zfast_stream_compressor compressor;
+  int level;
+  /* compressed size per 1024 bytes of the last trial */
+  uLong ratio;
+  /* speed, in 1/16 of MB/s (0 if unknown) */
+  uLong speed;
+  /* trials skipped (too slow candidate) */
+  uInt skipped;
+} zfast_auto_candidate;
+
+/* CPU-specific variant of the hot kernels, resolved once */
+typedef struct zfast_kernels {
+  /* variant name */
+  const char *name;
+#ifdef ZFAST_USE_FASTLZ
+  /* FastLZ compression with a persistent table */
+  int (*fastlz_compress)(fastlz_table* table, int level, const void* input,
+                         int length, void* output);
+  /* FastLZ decompression with FASTLZ_DECOMPRESS_SLACK bytes of slack */
+  int (*fastlz_decompress)(const void* input, int length, void* output,
+                           int maxout);
+#endif
+} zfast_kernels;
+
+/* persistent context of built-in backends, living as long as the stream */
+typedef struct zfast_backend_ctx {
+  /* kernels for this CPU */
+  const zfast_kernels *kernels;
+  /* attached preset dictionary, if any */
+  const zfast_dictionary *dict;
+#ifdef ZFAST_USE_FASTLZ
+  /* FastLZ persistent hash table (htab is NULL if not allocated) */
+  fastlz_table fastlz;
+#endif
+  /* LZ4 fast compression state (LZ4_stream_t) */
+  void *lz4;
+  /* LZ4 high compression state (LZ4_streamHC_t) */
+  void *lz4hc;
+  /* LZFSE encoding or decoding scratch buffer */
+  void *scratch;
+  /* size of the allocated scratch buffer */
+  uInt scratch_size;
+  /* writable bytes past the end of the current decompression output */
+  uInt out_slack;
+} zfast_backend_ctx;
+
 /* opaque structure for "state" zlib structure member */
 struct internal_state {
   /* magic ; must be BLOCK_MAGIC */
@@ -164,20 +395,135 @@ struct internal_state {
   /* current output stream size (output data block) */
   uInt dec_size;
 
-  /* buffered data input */
+  /* buffered data input (allocated on demand when decompressing) */
   Bytef *inBuff;
-  /* buffered data output */
+  /* buffered data output, and its size */
   Bytef *outBuff;
+  uInt outBuffSize;
+  /* where the current block is buffered (inBuff, or the end of outBuff when
+     decompressing in place) */
+  Bytef *inBlock;
   /* buffered data offset in inBuff (iff inBuffOffs < str_size)*/
   uInt inBuffOffs;
   /* buffered data offset in outBuff (iff outBuffOffs < dec_size)*/
   uInt outBuffOffs;
+  /* stored block exposed in place of outBuff by fastlzlibDecompressPeek(),
+     and peek in progress */
+  const Bytef *outView;
+  int peek;
   
-  /* block compression backend function */
-  int (*compress)(int level, const void* input, int length, void* output, int maxout);
+  /* backend compressor type (zfast_stream_compressor or
+     ZFAST_COMPRESSOR_CUSTOM) */
+  int compressor;
+
+  /* block compression backend function, and its context */
+  int (*compress)(void *ctx, int level, const void* input, int length,
+                  void* output, int maxout);
+  void *compress_ctx;
+
+  /* block decompression backend function, and its context */
+  int (*decompress)(void *ctx, const void* input, int length, void* output,
+                    int maxout);
+  void *decompress_ctx;
+
+  /* client-defined backend functions without context */
+  int (*compress_noctx)(int level, const void* input, int length,
+                        void* output, int maxout);
+  int (*decompress_noctx)(const void* input, int length, void* output,
+                          int maxout);
+
+  /* built-in backend context */
+  zfast_backend_ctx backend;
 
-  /* block decompression backend function */
-  int (*decompress)(const void* input, int length, void* output, int maxout); 
+  /* compressed blocks are tagged with their compressor
+     (OPTION_TAGGED_BLOCKS) */
+  int tagged;
+
+  /* adaptive compressor candidates (COMPRESSOR_AUTO), and the minimum speed
+     in MB/s (OPTION_MIN_SPEED) */
+  zfast_auto_candidate candidates[AUTO_CANDIDATES];
+  uInt nb_candidates;
+  uInt min_speed;
+  /* selected candidate, blocks before the next trial, and compressed size
+     per 1024 bytes of the previous block */
+  uInt auto_current;
+  uInt auto_blocks;
+  uLong auto_ratio;
+
+  /* linked blocks enabled (OPTION_LINKED_BLOCKS) */
+  int linked;
+  /* blocks between two keyframes (OPTION_KEYFRAME_INTERVAL) */
+  uInt keyframe_interval;
+  /* blocks emitted since the last keyframe (0: next block is a keyframe) */
+  uInt linked_count;
+
+  /* history of linked blocks, its capacity, and its used size */
+  Bytef *histBuff;
+  uInt histSize;
+  uInt histOffs;
+  /* the history chain started with the preset dictionary, which is not yet
+     part of histBuff */
+  int histDict;
+
+  /* preset dictionary set by fastlzlibSetDictionary() */
+  zfast_dictionary *dict;
+  /* stream information block written (compressing) */
+  int info_done;
+  /* EOF marker written (compressing) */
+  int eof_done;
+  /* dictionary identifier required by the stream (decompressing) */
+  uInt dict_id;
+  int dict_required;
+
+  /* checksums written (OPTION_CHECKSUMS) */
+  uInt checksums;
+  /* checksums declared by the stream information (decompressing) */
+  uInt flags;
+  /* checksums verification (OPTION_VERIFY_CHECKSUMS) */
+  int verify;
+  /* XXH64 of the content processed so far (ZFAST_CHECKSUM_CONTENT) */
+  XXH64_state_t content;
+
+  /* incompressible blocks detection (OPTION_DETECT_INCOMPRESSIBLE) */
+  int detect;
+  /* minimum gain, in percent (OPTION_MIN_GAIN) */
+  uInt min_gain;
+  /* blocks stored without trying after failures (OPTION_BACKOFF_BLOCKS) */
+  uInt backoff_blocks;
+  /* consecutive incompressible blocks, and remaining blocks to skip */
+  uInt failures;
+  uInt backoff;
+
+  /* size of the emitted pages, or zero (OPTION_PAGE_SIZE) */
+  uInt page_size;
+
+  /* seek index written after the EOF marker (OPTION_INDEX) */
+  int index;
+  /* seek index trailer being built (header, entries and room for the
+     footer), its capacity in entries, and the number of entries */
+  Bytef *indexBuff;
+  uInt indexCapacity;
+  uInt index_count;
+  /* seek index trailer pending on output (compressing) */
+  int index_done;
+  /* content and stream positions of the compressing stream */
+  uint64_t pos_in;
+  uint64_t pos_out;
+  /* seek index loaded by fastlzlibLoadIndex() (decompressing): entries,
+     number of entries, uncompressed size, footer flags and dictionary
+     identifier */
+  const Bytef *index_table;
+  uInt index_entries;
+  uint64_t index_length;
+  uInt index_flags;
+  uInt index_dict_id;
+  /* decompressed bytes to drop before the position sought */
+  uint64_t discard;
+  /* bytes of a seek index block left to skip (decompressing) */
+  uInt skip;
+
+  /* allocator set by fastlzlibSetAllocator() (if allocate is not NULL) */
+  zfast_allocator allocator;
 };
 
 /* our typed internal state */
@@ -188,6 +534,62 @@ const char * fastlzlibVersion() {
   return FASTLZ_VERSION_STRING;
 }
 
+/* name of the kernels built without specific target */
+#if defined(__AVX2__) && !defined(FASTLZ_NO_SIMD)
+#define KERNELS_DEFAULT_NAME "avx2"
+#elif ( defined(__x86_64__) || defined(_M_X64) ) && !defined(FASTLZ_NO_SIMD)
+#define KERNELS_DEFAULT_NAME "sse2"
+#else
+#define KERNELS_DEFAULT_NAME "generic"
+#endif
+
+static const zfast_kernels kernels_default = {
+  KERNELS_DEFAULT_NAME
+#ifdef ZFAST_USE_FASTLZ
+  , fastlz_compress_table, fastlz_decompress_fast
+#endif
+};
+
+#ifdef FASTLZ_HAVE_VARIANTS
+static const zfast_kernels kernels_avx2 = {
+  "avx2", fastlz_compress_table_avx2, fastlz_decompress_fast_avx2
+};
+#endif
+
+/* selected kernels */
+static const zfast_kernels *kernels = NULL;
+
+/* select the kernels supported by this CPU */
+static void fastlzlibKernelsResolve(void) {
+  const zfast_kernels *k = &kernels_default;
+#ifdef FASTLZ_HAVE_VARIANTS
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi")
+      && __builtin_cpu_supports("bmi2")) {
+    k = &kernels_avx2;
+  }
+#endif
+  kernels = k;
+}
+
+/* get the kernels, resolved upon first call */
+static const zfast_kernels* fastlzlibKernels(void) {
+#ifdef ZFAST_USE_THREADS
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, fastlzlibKernelsResolve);
+#else
+  if (kernels == NULL) {
+    fastlzlibKernelsResolve();
+  }
+#endif
+  return kernels;
+}
+
+/* kernels variant */
+const char * fastlzlibVariant() {
+  return fastlzlibKernels()->name;
+}
+
 /* get the block size */
 int fastlzlibGetBlockSize(zfast_stream *s) {
   if (s != NULL && s->state != NULL) {
@@ -233,25 +635,134 @@ static void zfree(zfast_stream *s, voidpf address) {
   }
 }
 
+/* allocate "size" bytes of the kind "hint" (zfast_alloc_hint) for the
+   stream, using the allocator set by fastlzlibSetAllocator() if any */
+static voidpf buff_zalloc(zfast_stream *s, uInt size, int hint) {
+  const zfast_allocator *const allocator = &s->state->allocator;
+  if (allocator->allocate != NULL) {
+    return allocator->allocate(allocator->opaque, size, ALLOC_ALIGNMENT,
+                               hint);
+  }
+  return zalloc(s, size, 1);
+}
+
+/* free stream memory of "size" bytes */
+static void buff_zfree(zfast_stream *s, voidpf address, uInt size) {
+  const zfast_allocator *const allocator = &s->state->allocator;
+  if (allocator->allocate != NULL) {
+    allocator->deallocate(allocator->opaque, address, size, ALLOC_ALIGNMENT);
+  } else {
+    zfree(s, address);
+  }
+}
+
+#ifdef ZFAST_USE_LZ4
+
+/* allocate memory for a dictionary, using the stream allocator if any */
+static voidpf dict_zalloc(zfast_stream *s, uInt size) {
+  return s != NULL ? buff_zalloc(s, size, ZFAST_ALLOC_CONTEXT)
+    : default_zalloc(size, 1);
+}
+
+#endif
+
+/* free dictionary memory */
+static void dict_zfree(zfast_stream *s, voidpf address, uInt size) {
+  if (address != NULL) {
+    if (s != NULL) {
+      buff_zfree(s, address, size);
+    } else {
+      default_zfree(address);
+    }
+  }
+}
+
+/* free a dictionary allocated for the stream "s" (or NULL) */
+static void fastlzlibDictionaryFree(zfast_stream *s, zfast_dictionary *dict) {
+  if (dict != NULL) {
+    dict_zfree(s, dict->data, dict->size != 0 ? dict->size : 1);
+#ifdef ZFAST_USE_LZ4
+    dict_zfree(s, dict->lz4, sizeof(LZ4_stream_t));
+    dict_zfree(s, dict->lz4hc, sizeof(LZ4_streamHC_t));
+#endif
+    dict_zfree(s, dict, sizeof(zfast_dictionary));
+  }
+}
+
+/* free built-in backend context */
+static void fastlzlibBackendFree(zfast_stream *s) {
+  zfast_backend_ctx *const ctx = &s->state->backend;
+#ifdef ZFAST_USE_LZ4
+  if (ctx->lz4 != NULL) {
+    buff_zfree(s, ctx->lz4, sizeof(LZ4_stream_t));
+    ctx->lz4 = NULL;
+  }
+  if (ctx->lz4hc != NULL) {
+    buff_zfree(s, ctx->lz4hc, sizeof(LZ4_streamHC_t));
+    ctx->lz4hc = NULL;
+  }
+#endif
+  if (ctx->scratch != NULL) {
+    buff_zfree(s, ctx->scratch, ctx->scratch_size);
+    ctx->scratch = NULL;
+    ctx->scratch_size = 0;
+  }
+#ifdef ZFAST_USE_FASTLZ
+  if (ctx->fastlz.htab != NULL) {
+    buff_zfree(s, ctx->fastlz.htab, FASTLZ_TABLE_BYTES(ctx->fastlz.log));
+    ctx->fastlz.htab = NULL;
+  }
+#endif
+}
+
 /* free private fields */
 static void fastlzlibFree(zfast_stream *s) {
   if (s != NULL) {
     if (s->state != NULL) {
       assert(strcmp(s->state->magic, MAGIC) == 0);
+      fastlzlibBackendFree(s);
+      if (s->state->histBuff != NULL) {
+        buff_zfree(s, s->state->histBuff, s->state->histSize);
+        s->state->histBuff = NULL;
+      }
+      if (s->state->dict != NULL) {
+        fastlzlibDictionaryFree(s, s->state->dict);
+        s->state->dict = NULL;
+      }
       if (s->state->inBuff != NULL) {
-        zfree(s, s->state->inBuff);
+        buff_zfree(s, s->state->inBuff, INPUT_BUFFER_SIZE(s));
         s->state->inBuff = NULL;
       }
       if (s->state->outBuff != NULL) {
-        zfree(s, s->state->outBuff);
+        buff_zfree(s, s->state->outBuff, s->state->outBuffSize);
         s->state->outBuff = NULL;
       }
-      zfree(s, s->state);
+      if (s->state->indexBuff != NULL) {
+        buff_zfree(s, s->state->indexBuff,
+                   INDEX_TRAILER_SIZE(s->state->indexCapacity));
+        s->state->indexBuff = NULL;
+      }
+      buff_zfree(s, s->state, sizeof(zfast_stream_internal));
       s->state = NULL;
     }
   }
 }
 
+/* default options (see fastlzlibSetOption()) */
+static void fastlzlibDefaults(zfast_stream *s) {
+  s->state->linked = 0;
+  s->state->keyframe_interval = DEFAULT_KEYFRAME_INTERVAL;
+  s->state->tagged = 0;
+  s->state->min_speed = 0;
+  s->state->detect = 1;
+  s->state->min_gain = 0;
+  s->state->backoff_blocks = 0;
+  s->state->page_size = 0;
+  s->state->checksums = 0;
+  s->state->verify = 1;
+  s->state->index = 0;
+}
+
 /* reset internal state */
 static void fastlzlibReset(zfast_stream *s) {
   assert(strcmp(s->state->magic, MAGIC) == 0);
@@ -262,6 +773,23 @@ static void fastlzlibReset(zfast_stream *s) {
   s->state->dec_size = 0;
   s->state->inBuffOffs = 0;
   s->state->outBuffOffs = 0;
+  s->state->outView = NULL;
+  s->state->linked_count = 0;
+  s->state->histOffs = 0;
+  s->state->histDict = 0;
+  s->state->info_done = 0;
+  s->state->eof_done = 0;
+  s->state->dict_required = 0;
+  s->state->flags = 0;
+  XXH64_reset(&s->state->content, 0);
+  s->state->failures = 0;
+  s->state->backoff = 0;
+  s->state->index_count = 0;
+  s->state->index_done = 0;
+  s->state->pos_in = 0;
+  s->state->pos_out = 0;
+  s->state->discard = 0;
+  s->state->skip = 0;
   s->total_in = 0;
   s->total_out = 0;
 }
@@ -278,19 +806,94 @@ static ZFASTINLINE int fastlzlibGetBlockSizeLevel(int block_size) {
 
 #ifdef ZFAST_USE_LZ4
 
-/* compression backend for LZ4 */
-static int lz4_backend_compress(int level, const void* input, int length,
-                                void* output, int maxout) {
-  const int lz4Level = LZ4HC_CLEVEL_MIN + (level * (LZ4HC_CLEVEL_MAX - LZ4HC_CLEVEL_MIN))/Z_BEST_COMPRESSION;
-  if (lz4Level < LZ4HC_CLEVEL_MAX) {
-    return LZ4_compress_HC(input, output, length, maxout, lz4Level);
+/* LZ4 levels for stream levels 0 .. 9: positive values are LZ4 HC levels
+   (LZ4HC_CLEVEL_OPT_MIN and above use the optimal parser), and negative values
+   are LZ4_compress_fast accelerations, negated */
+static const int lz4_levels[Z_BEST_COMPRESSION + 1] = {
+  -1,                    /* 0 */
+  -1,                    /* 1: Z_BEST_SPEED */
+  LZ4HC_CLEVEL_MIN,      /* 2 */
+  4,                     /* 3 */
+  6,                     /* 4 */
+  8,                     /* 5 */
+  LZ4HC_CLEVEL_DEFAULT,  /* 6: Z_DEFAULT_COMPRESSION */
+  LZ4HC_CLEVEL_OPT_MIN,  /* 7 */
+  11,                    /* 8 */
+  LZ4HC_CLEVEL_MAX       /* 9: Z_BEST_COMPRESSION */
+};
+
+/* LZ4 compression level, given the stream level (negative stream levels
+   map directly to increasing accelerations) */
+static ZFASTINLINE int lz4_backend_level(int level) {
+  if (level < Z_NO_COMPRESSION) {
+    return level;
+  } else if (level > Z_BEST_COMPRESSION) {
+    level = Z_BEST_COMPRESSION;
+  }
+  return lz4_levels[level];
+}
+
+/* is the LZ4 high compression mode used for this stream level ? */
+static ZFASTINLINE int lz4_backend_is_hc(int level) {
+  return lz4_backend_level(level) > 0;
+}
+
+/* compression backend for LZ4 (states are reset, not rebuilt, per block) */
+static int lz4_backend_compress(void *ctx, int level, const void* input,
+                                int length, void* output, int maxout) {
+  zfast_backend_ctx *const backend = (zfast_backend_ctx*) ctx;
+  const int lz4Level = lz4_backend_level(level);
+  if (lz4Level > 0) {
+    assert(backend->lz4hc != NULL);
+    /* attach the digested dictionary (no table rebuilt) */
+    if (backend->dict != NULL) {
+      LZ4_resetStreamHC_fast(backend->lz4hc, lz4Level);
+      LZ4_attach_HC_dictionary(backend->lz4hc, backend->dict->lz4hc);
+      return LZ4_compress_HC_continue(backend->lz4hc, input, output, length,
+                                      maxout);
+    }
+    return LZ4_compress_HC_extStateHC_fastReset(backend->lz4hc, input, output,
+                                                length, maxout, lz4Level);
+  }
+  assert(backend->lz4 != NULL);
+  if (backend->dict != NULL) {
+    LZ4_resetStream_fast(backend->lz4);
+    LZ4_attach_dictionary(backend->lz4, backend->dict->lz4);
+    return LZ4_compress_fast_continue(backend->lz4, input, output, length,
+                                      maxout, -lz4Level);
+  }
+  return LZ4_compress_fast_extState_fastReset(backend->lz4, input, output,
+                                              length, maxout, -lz4Level);
+}
+
+/* compress as much of "input" as fits in "maxout" bytes, "*length" being
+   updated with the consumed size (the fast compressor has no destSize
+   variant using a dictionary nor an acceleration: both are ignored) */
+static int lz4_backend_compress_dest(void *ctx, int level, const void* input,
+                                     int *length, void* output, int maxout) {
+  zfast_backend_ctx *const backend = (zfast_backend_ctx*) ctx;
+  const int lz4Level = lz4_backend_level(level);
+  if (lz4Level > 0) {
+    assert(backend->lz4hc != NULL);
+    LZ4_resetStreamHC_fast(backend->lz4hc, lz4Level);
+    if (backend->dict != NULL) {
+      LZ4_attach_HC_dictionary(backend->lz4hc, backend->dict->lz4hc);
+    }
+    return LZ4_compress_HC_continue_destSize(backend->lz4hc, input, output,
+                                             length, maxout);
   }
-  return LZ4_compress_default(input, output, length, maxout);
+  return LZ4_compress_destSize(input, output, length, maxout);
 }
 
 /* decompression backend for LZ4 */
-static int lz4_backend_decompress(const void* input, int length, void* output,
-                                  int maxout) {
+static int lz4_backend_decompress(void *ctx, const void* input, int length,
+                                  void* output, int maxout) {
+  const zfast_backend_ctx *const backend = (const zfast_backend_ctx*) ctx;
+  if (backend->dict != NULL) {
+    return LZ4_decompress_safe_usingDict(input, output, length, maxout,
+                                         (const char*) backend->dict->data,
+                                         backend->dict->size);
+  }
   return LZ4_decompress_safe(input, output, length, maxout);
   /* return LZ4_uncompress(input, output, maxout); */
 }
@@ -300,16 +903,31 @@ static int lz4_backend_decompress(const void* input, int length, void* output,
 #ifdef ZFAST_USE_FASTLZ
 
 /* compression backend for FastLZ (level adjustment) */
-static int fastlz_backend_compress(int level, const void* input, int length,
-                                   void* output, int maxout) {
-  (void) maxout;
+static int fastlz_backend_compress(void *ctx, int level, const void* input,
+                                   int length, void* output, int maxout) {
+  zfast_backend_ctx *const backend = (zfast_backend_ctx*) ctx;
   /* Level 1 is the fastest compression and generally useful for short data.
      Level 2 is slightly slower but it gives better compression ratio. */
   const int l = level <= Z_BEST_SPEED ? 1 : 2;
+  (void) maxout;
+  /* use the stream hash table, which does not need to be cleared */
+  if (backend->fastlz.htab != NULL) {
+    return backend->kernels->fastlz_compress(&backend->fastlz, l, input,
+                                             length, output);
+  }
   return fastlz_compress_level(l, input, length, output);
 }
 
-#define fastlz_backend_decompress fastlz_decompress
+/* decompression backend for FastLZ */
+static int fastlz_backend_decompress(void *ctx, const void* input, int length,
+                                     void* output, int maxout) {
+  const zfast_backend_ctx *const backend = (const zfast_backend_ctx*) ctx;
+  /* wide copies need some room past the output end */
+  if (backend->out_slack >= FASTLZ_DECOMPRESS_SLACK) {
+    return backend->kernels->fastlz_decompress(input, length, output, maxout);
+  }
+  return fastlz_decompress(input, length, output, maxout);
+}
 
 #endif
 
@@ -320,32 +938,266 @@ static int fastlz_backend_compress(int level, const void* input, int length,
 /*   if compressed data are greather than input (incompressible data), 
             lzfse_encode_buffer return 0
             fastlzlib wait length to decide store a RAW block, so we transform return value */
-static int lzfse_backend_compress(int level, const void* input, int length,
-                                  void* output, int maxout) {
-  void* scratch_buffer = (void*)malloc(lzfse_encode_scratch_size());
-  if (scratch_buffer == NULL)
-    return 0;
-  int size_compressed = (int)lzfse_encode_buffer(output, (size_t)length, input, (size_t)length, scratch_buffer);
-  free(scratch_buffer);
+static int lzfse_backend_compress(void *ctx, int level, const void* input,
+                                  int length, void* output, int maxout) {
+  zfast_backend_ctx *const backend = (zfast_backend_ctx*) ctx;
+  int size_compressed;
+  (void) level;
+  (void) maxout;
+  assert(backend->scratch != NULL);
+  size_compressed = (int)lzfse_encode_buffer(output, (size_t)length, input, (size_t)length, backend->scratch);
   return (size_compressed == 0) ? length : size_compressed;
 }
 
 /* decompression backend for LZFSE */
-static int lzfse_backend_decompress(const void* input, int length, void* output,
-                                    int maxout) {
-  int size_decoded;
-  void* scratch_buffer = (void*)malloc(lzfse_decode_scratch_size());
-  if (scratch_buffer == NULL)
-    return 0;
-  size_decoded = lzfse_decode_buffer(output, maxout, input, length, scratch_buffer);
-  free(scratch_buffer);
-  return size_decoded;
-  /* return LZ4_uncompress(input, output, maxout); */
+static int lzfse_backend_decompress(void *ctx, const void* input, int length,
+                                    void* output, int maxout) {
+  zfast_backend_ctx *const backend = (zfast_backend_ctx*) ctx;
+  assert(backend->scratch != NULL);
+  return (int) lzfse_decode_buffer(output, maxout, input, length,
+                                   backend->scratch);
+}
+#endif
+
+/* client-defined compression backend without context */
+static int noctx_backend_compress(void *ctx, int level, const void* input,
+                                  int length, void* output, int maxout) {
+  const zfast_stream_internal *const state = (zfast_stream_internal*) ctx;
+  return state->compress_noctx(level, input, length, output, maxout);
+}
+
+/* client-defined decompression backend without context */
+static int noctx_backend_decompress(void *ctx, const void* input, int length,
+                                    void* output, int maxout) {
+  const zfast_stream_internal *const state = (zfast_stream_internal*) ctx;
+  return state->decompress_noctx(input, length, output, maxout);
+}
+
+#ifdef ZFAST_USE_LZFSE
+
+/* allocate a scratch buffer of at least "size" bytes for the backend */
+static ZFASTINLINE int fastlzlibBackendScratch(zfast_stream *s, uInt size) {
+  zfast_backend_ctx *const ctx = &s->state->backend;
+  if (ctx->scratch_size < size) {
+    if (ctx->scratch != NULL) {
+      buff_zfree(s, ctx->scratch, ctx->scratch_size);
+      ctx->scratch_size = 0;
+    }
+    ctx->scratch = buff_zalloc(s, size, ZFAST_ALLOC_BUFFER);
+    if (ctx->scratch == NULL) {
+      return Z_MEM_ERROR;
+    }
+    ctx->scratch_size = size;
+  }
+  return Z_OK;
+}
+
+#endif
+
+/* allocate the built-in backend context needed by the current compressor and
+   level on first use, unless already done (contexts are kept until the
+   stream ends) */
+#ifdef ZFAST_USE_LZ4
+
+/* allocate the LZ4 fast ("hc" == 0) or high compression state */
+static int fastlzlibBackendLZ4(zfast_stream *s, int hc) {
+  zfast_backend_ctx *const ctx = &s->state->backend;
+  if (hc) {
+    if (ctx->lz4hc == NULL) {
+      ctx->lz4hc = buff_zalloc(s, sizeof(LZ4_streamHC_t),
+                               ZFAST_ALLOC_CONTEXT);
+      if (ctx->lz4hc == NULL) {
+        return Z_MEM_ERROR;
+      }
+      LZ4_initStreamHC(ctx->lz4hc, sizeof(LZ4_streamHC_t));
+    }
+  } else if (ctx->lz4 == NULL) {
+    ctx->lz4 = buff_zalloc(s, sizeof(LZ4_stream_t), ZFAST_ALLOC_CONTEXT);
+    if (ctx->lz4 == NULL) {
+      return Z_MEM_ERROR;
+    }
+    LZ4_initStream(ctx->lz4, sizeof(LZ4_stream_t));
+  }
+  return Z_OK;
+}
+
+#endif
+
+#ifdef ZFAST_USE_FASTLZ
+
+/* allocate the FastLZ hash table, sized after the block size (16 entries
+   per byte) */
+static int fastlzlibBackendFastLZ(zfast_stream *s) {
+  zfast_backend_ctx *const ctx = &s->state->backend;
+  if (ctx->fastlz.htab == NULL) {
+    unsigned int log = FASTLZ_TABLE_MIN_LOG;
+    void *htab;
+    while(log < FASTLZ_TABLE_MAX_LOG
+          && ( 1u << ( log - 4 ) ) < s->state->block_size) {
+      log++;
+    }
+    htab = buff_zalloc(s, FASTLZ_TABLE_BYTES(log), ZFAST_ALLOC_CONTEXT);
+    if (htab == NULL) {
+      return Z_MEM_ERROR;
+    }
+    fastlz_table_init(&ctx->fastlz, htab, log);
+  }
+  return Z_OK;
+}
+
+#endif
+
+/* allocate the backend context of the stream compressor */
+static int fastlzlibBackendPrepare(zfast_stream *s) {
+  switch(s->state->compressor) {
+#ifdef ZFAST_USE_FASTLZ
+  case COMPRESSOR_FASTLZ:
+    if (ZFAST_IS_COMPRESSING(s)) {
+      return fastlzlibBackendFastLZ(s);
+    }
+    break;
+#endif
+#ifdef ZFAST_USE_LZ4
+  case COMPRESSOR_LZ4:
+    if (ZFAST_IS_COMPRESSING(s)) {
+      return fastlzlibBackendLZ4(s, lz4_backend_is_hc(s->state->level));
+    }
+    break;
+#endif
+#ifdef ZFAST_USE_LZFSE
+  case COMPRESSOR_LZFSE:
+    return fastlzlibBackendScratch(s, (uInt) ( ZFAST_IS_COMPRESSING(s)
+                                               ? lzfse_encode_scratch_size()
+                                               : lzfse_decode_scratch_size() ));
+#endif
+  case COMPRESSOR_AUTO:
+    if (ZFAST_IS_COMPRESSING(s)) {
+      uInt i;
+      for(i = 0 ; i < s->state->nb_candidates ; i++) {
+        const zfast_auto_candidate *const c = &s->state->candidates[i];
+        int code = Z_OK;
+#ifdef ZFAST_USE_FASTLZ
+        if (c->compressor == COMPRESSOR_FASTLZ) {
+          code = fastlzlibBackendFastLZ(s);
+        }
+#endif
+#ifdef ZFAST_USE_LZ4
+        if (c->compressor == COMPRESSOR_LZ4) {
+          code = fastlzlibBackendLZ4(s, lz4_backend_is_hc(c->level));
+        }
+#endif
+#ifdef ZFAST_USE_LZFSE
+        if (c->compressor == COMPRESSOR_LZFSE) {
+          code = fastlzlibBackendScratch(s, (uInt)
+                                         lzfse_encode_scratch_size());
+        }
+#endif
+        if (code != Z_OK) {
+          return code;
+        }
+        (void) c;
+      }
+    }
+    break;
+  default:
+    break;
+  }
+  return Z_OK;
+}
+
+/* built-in backend context memory size */
+static uInt fastlzlibBackendMemory(zfast_stream *s) {
+  const zfast_backend_ctx *const ctx = &s->state->backend;
+  uInt size = ctx->scratch_size;
+#ifdef ZFAST_USE_FASTLZ
+  if (ctx->fastlz.htab != NULL) {
+    size += FASTLZ_TABLE_BYTES(ctx->fastlz.log);
+  }
+#endif
+#ifdef ZFAST_USE_LZ4
+  if (ctx->lz4 != NULL) {
+    size += sizeof(LZ4_stream_t);
+  }
+  if (ctx->lz4hc != NULL) {
+    size += sizeof(LZ4_streamHC_t);
+  }
+#endif
+  return size;
+}
+
+/* upper bound of the data written by the compressor "compressor" from
+   "length" bytes: backends honoring their output limit fall back to raw data
+   (the input size), while FastLZ needs room for its worst case expansion */
+static ZFASTINLINE uInt fastlzlibBackendBound(const zfast_stream *const s,
+                                              int compressor, uInt length) {
+  switch(compressor) {
+#ifdef ZFAST_USE_FASTLZ
+  case COMPRESSOR_FASTLZ:
+    return FASTLZ_COMPRESS_BOUND(length);
+#endif
+  case COMPRESSOR_AUTO:
+    {
+      uInt bound = length;
+      uInt i;
+      for(i = 0 ; i < s->state->nb_candidates ; i++) {
+        const uInt size = fastlzlibBackendBound(s,
+                                                s->state->candidates[i]
+                                                .compressor, length);
+        if (size > bound) {
+          bound = size;
+        }
+      }
+      return bound;
+    }
+  default:
+    return length;
+  }
 }
+
+/* upper bound of a block of "length" bytes, header included, for the stream
+   compressor, or any built-in compressor if "s" is NULL ; client backends may
+   not honor their output limit, and are given the historical estimate */
+static uInt fastlzlibBlockBound(const zfast_stream *const s, uInt length) {
+  if (s == NULL) {
+#ifdef ZFAST_USE_FASTLZ
+    return HEADER_SIZE + FASTLZ_COMPRESS_BOUND(length);
+#else
+    return HEADER_SIZE + length;
 #endif
+  }
+  if (s->state->compressor == ZFAST_COMPRESSOR_CUSTOM) {
+    return length + length / EXPANSION_RATIO + EXPANSION_SECURITY
+      + ZFAST_BLOCK_CHECKSUM_SIZE(s->state->checksums);
+  }
+  return HEADER_SIZE
+    + fastlzlibBackendBound(s, s->state->compressor, length)
+    + ZFAST_BLOCK_CHECKSUM_SIZE(s->state->checksums);
+}
+
+/* allocate the output buffer, or grow it if the current compressor needs a
+   larger one (its content is lost): the largest block written by
+   fastlz_compress_hdr(), or the decompressed block */
+static int fastlzlibOutBuff(zfast_stream *s) {
+  const uInt size = ZFAST_IS_COMPRESSING(s)
+    ? INFO_MAX_SIZE + fastlzlibBlockBound(s, BLOCK_SIZE(s))
+      + ZFAST_EOF_SIZE(s->state->checksums)
+    : DECOMPRESS_BUFFER_SIZE(s);
+  if (s->state->outBuffSize < size) {
+    if (s->state->outBuff != NULL) {
+      buff_zfree(s, s->state->outBuff, s->state->outBuffSize);
+      s->state->outBuffSize = 0;
+    }
+    s->state->outBuff = buff_zalloc(s, size, ZFAST_ALLOC_BUFFER);
+    if (s->state->outBuff == NULL) {
+      return Z_MEM_ERROR;
+    }
+    s->state->outBuffSize = size;
+  }
+  return Z_OK;
+}
 
 /* initialize private fields */
-static int fastlzlibInit(zfast_stream *s, int block_size) {
+static int fastlzlibInit(zfast_stream *s, int level, int block_size) {
   if (s != NULL) {
     int code;
     if (fastlzlibGetBlockSizeLevel(block_size) == -1) {
@@ -354,38 +1206,45 @@ static int fastlzlibInit(zfast_stream *s, int block_size) {
     }
     s->state = (zfast_stream_internal*)
       zalloc(s, sizeof(zfast_stream_internal), 1);
+    if (s->state == NULL) {
+      s->msg = "memory exhausted";
+      return Z_MEM_ERROR;
+    }
+    memset(s->state, 0, sizeof(zfast_stream_internal));
     strcpy(s->state->magic, MAGIC);
+    s->state->level = level;
+    fastlzlibDefaults(s);
+    s->state->backend.kernels = fastlzlibKernels();
     s->state->compress = NULL;
     s->state->decompress = NULL;
+    s->state->block_size = (uInt) block_size;
     if ( ( code = fastlzlibSetCompressor(s, COMPRESSOR_DEFAULT) ) != Z_OK) {
       fastlzlibFree(s);
       return code;
     }
-    s->state->block_size = (uInt) block_size;
-    s->state->inBuff = zalloc(s, BUFFER_BLOCK_SIZE(s), 1);
-    s->state->outBuff = zalloc(s, BUFFER_BLOCK_SIZE(s), 1);
-    if (s->state->inBuff != NULL && s->state->outBuff != NULL) {
-      fastlzlibReset(s);
-      return Z_OK;
-    }
-    s->msg = "memory exhausted";
-    fastlzlibFree(s);
+    /* buffers are allocated on first need (see fastlzlibInBlock() and
+       fastlzlibOutBuff()) */
+    fastlzlibReset(s);
+    return Z_OK;
   } else {
     return Z_STREAM_ERROR;
   }
-  return Z_MEM_ERROR;
 }
 
-int fastlzlibCompressInit2(zfast_stream *s, int level, int block_size) {
-  const int success = fastlzlibInit(s, block_size);
-  if (success == Z_OK) {
-    /* default or unrecognized compression level */
-    if (level < Z_NO_COMPRESSION || level > Z_BEST_COMPRESSION) {
-      level = Z_BEST_COMPRESSION;
-    }
-    s->state->level = level;
+/* default or unrecognized compression level */
+static int fastlzlibNormalizeLevel(int level) {
+  if (level == Z_DEFAULT_COMPRESSION) {
+    return DEFAULT_LEVEL;
+  } else if (level < ZFAST_LEVEL_FASTEST) {
+    return ZFAST_LEVEL_FASTEST;
+  } else if (level > Z_BEST_COMPRESSION) {
+    return Z_BEST_COMPRESSION;
   }
-  return success;
+  return level;
+}
+
+int fastlzlibCompressInit2(zfast_stream *s, int level, int block_size) {
+  return fastlzlibInit(s, fastlzlibNormalizeLevel(level), block_size);
 }
 
 int fastlzlibCompressInit(zfast_stream *s, int level) {
@@ -393,11 +1252,7 @@ int fastlzlibCompressInit(zfast_stream *s, int level) {
 }
 
 int fastlzlibDecompressInit2(zfast_stream *s, int block_size) {
-  const int success = fastlzlibInit(s, block_size);
-  if (success == Z_OK) {
-    s->state->level = ZFAST_LEVEL_DECOMPRESS;
-  }
-  return success;
+  return fastlzlibInit(s, ZFAST_LEVEL_DECOMPRESS, block_size);
 }
 
 int fastlzlibDecompressInit(zfast_stream *s) {
@@ -408,39 +1263,753 @@ void fastlzlibSetCompress(zfast_stream *s,
                           int (*compress)(int level, const void* input,
                                           int length, void* output,
                                           int maxout)) {
-  s->state->compress = compress;
+  s->state->compress_noctx = compress;
+  fastlzlibSetCompress2(s, noctx_backend_compress, s->state);
 }
 
 void fastlzlibSetDecompress(zfast_stream *s,
                             int (*decompress)(const void* input, int length,
                                               void* output, int maxout)) {
+  s->state->decompress_noctx = decompress;
+  fastlzlibSetDecompress2(s, noctx_backend_decompress, s->state);
+}
+
+void fastlzlibSetCompress2(zfast_stream *s,
+                           int (*compress)(void *ctx, int level,
+                                           const void* input, int length,
+                                           void* output, int maxout),
+                           void *ctx) {
+  s->state->compressor = ZFAST_COMPRESSOR_CUSTOM;
+  s->state->compress = compress;
+  s->state->compress_ctx = ctx;
+}
+
+void fastlzlibSetDecompress2(zfast_stream *s,
+                             int (*decompress)(void *ctx, const void* input,
+                                               int length, void* output,
+                                               int maxout),
+                             void *ctx) {
+  s->state->compressor = ZFAST_COMPRESSOR_CUSTOM;
   s->state->decompress = decompress;
+  s->state->decompress_ctx = ctx;
 }
 
-int fastlzlibSetCompressor(zfast_stream *s,
-                           zfast_stream_compressor compressor) {
-#ifdef ZFAST_USE_LZ4
-  if (compressor == COMPRESSOR_LZ4) {
-    fastlzlibSetCompress(s, lz4_backend_compress);
-    fastlzlibSetDecompress(s, lz4_backend_decompress);
-    return Z_OK;
+#if defined(ZFAST_USE_FASTLZ) || defined(ZFAST_USE_LZ4) \
+  || defined(ZFAST_USE_LZFSE)
+
+/* set a built-in backend, and allocate its persistent context */
+static int fastlzlibSetBackend(zfast_stream *s,
+                               zfast_stream_compressor compressor,
+                               int (*compress)(void *ctx, int level,
+                                               const void* input, int length,
+                                               void* output, int maxout),
+                               int (*decompress)(void *ctx, const void* input,
+                                                 int length, void* output,
+                                                 int maxout)) {
+  /* switching compressors within a stream: blocks must be tagged, and the
+     linked blocks chain restarts */
+  if (ZFAST_IS_COMPRESSING(s) && s->total_in != 0
+      && (int) compressor != s->state->compressor) {
+    s->state->tagged = 1;
+    s->state->linked_count = 0;
+  }
+  fastlzlibSetCompress2(s, compress, &s->state->backend);
+  fastlzlibSetDecompress2(s, decompress, &s->state->backend);
+  s->state->compressor = compressor;
+  return Z_OK;
+}
+
+/* register a candidate of the adaptive compressor */
+static void fastlzlibAutoAdd(zfast_stream *s,
+                             zfast_stream_compressor compressor, int level) {
+  zfast_auto_candidate *const c =
+    &s->state->candidates[s->state->nb_candidates++];
+  assert(s->state->nb_candidates <= AUTO_CANDIDATES);
+  memset(c, 0, sizeof(*c));
+  c->compressor = compressor;
+  c->level = level;
+}
+
+#endif
+
+/* candidates of the adaptive compressor: the fast and strong variants of
+   each built-in compressor, strong ones using the stream level if high
+   enough */
+static void fastlzlibAutoInit(zfast_stream *s) {
+  const int level = s->state->level;
+  s->state->nb_candidates = 0;
+  s->state->auto_current = 0;
+  s->state->auto_blocks = 0;
+  s->state->auto_ratio = 0;
+#ifdef ZFAST_USE_FASTLZ
+  fastlzlibAutoAdd(s, COMPRESSOR_FASTLZ, Z_BEST_SPEED);
+  fastlzlibAutoAdd(s, COMPRESSOR_FASTLZ, Z_BEST_COMPRESSION);
+#endif
+#ifdef ZFAST_USE_LZ4
+  fastlzlibAutoAdd(s, COMPRESSOR_LZ4,
+                   level <= Z_BEST_SPEED ? level : Z_BEST_SPEED);
+  fastlzlibAutoAdd(s, COMPRESSOR_LZ4,
+                   level > Z_BEST_SPEED ? level : DEFAULT_LEVEL);
+#endif
+#ifdef ZFAST_USE_LZFSE
+  fastlzlibAutoAdd(s, COMPRESSOR_LZFSE, level);
+#endif
+  (void) level;
+}
+
+int fastlzlibSetCompressor(zfast_stream *s,
+                           zfast_stream_compressor compressor) {
+#ifdef ZFAST_USE_LZ4
+  if (compressor == COMPRESSOR_LZ4) {
+    return fastlzlibSetBackend(s, compressor, lz4_backend_compress,
+                               lz4_backend_decompress);
   }
 #endif
 #ifdef ZFAST_USE_FASTLZ
   if (compressor == COMPRESSOR_FASTLZ) {
-    fastlzlibSetCompress(s, fastlz_backend_compress);
-    fastlzlibSetDecompress(s, fastlz_backend_decompress);
-    return Z_OK;
+    return fastlzlibSetBackend(s, compressor, fastlz_backend_compress,
+                               fastlz_backend_decompress);
   }
 #endif
 #ifdef ZFAST_USE_LZFSE
   if (compressor == COMPRESSOR_LZFSE) {
-    fastlzlibSetCompress(s, lzfse_backend_compress);
-    fastlzlibSetDecompress(s, lzfse_backend_decompress);
+    return fastlzlibSetBackend(s, compressor, lzfse_backend_compress,
+                               lzfse_backend_decompress);
+  }
+#endif
+  /* blocks are tagged ; untagged blocks use the first built-in compressor */
+  if (compressor == COMPRESSOR_AUTO) {
+    if (ZFAST_IS_COMPRESSING(s)) {
+      fastlzlibAutoInit(s);
+      s->state->tagged = 1;
+    }
+#if defined(ZFAST_USE_FASTLZ)
+    return fastlzlibSetBackend(s, compressor, fastlz_backend_compress,
+                               fastlz_backend_decompress);
+#elif defined(ZFAST_USE_LZ4)
+    return fastlzlibSetBackend(s, compressor, lz4_backend_compress,
+                               lz4_backend_decompress);
+#elif defined(ZFAST_USE_LZFSE)
+    return fastlzlibSetBackend(s, compressor, lzfse_backend_compress,
+                               lzfse_backend_decompress);
+#endif
+  }
+  return Z_VERSION_ERROR;
+}
+
+int fastlzlibSetOption(zfast_stream *s, zfast_stream_option option,
+                       int value) {
+  if (s == NULL || s->state == NULL) {
+    return Z_STREAM_ERROR;
+  }
+  switch(option) {
+  case OPTION_LINKED_BLOCKS:
+    s->state->linked = value != 0;
+    /* next block is a keyframe */
+    s->state->linked_count = 0;
+    return Z_OK;
+  case OPTION_KEYFRAME_INTERVAL:
+    if (value < 0) {
+      break;
+    }
+    s->state->keyframe_interval = (uInt) value;
+    return Z_OK;
+  case OPTION_MIN_SPEED:
+    if (value < 0) {
+      break;
+    }
+    s->state->min_speed = (uInt) value;
+    return Z_OK;
+  case OPTION_TAGGED_BLOCKS:
+    s->state->tagged = value != 0;
+    return Z_OK;
+  case OPTION_DETECT_INCOMPRESSIBLE:
+    s->state->detect = value != 0;
     return Z_OK;
+  case OPTION_MIN_GAIN:
+    if (value < 0 || value > 99) {
+      break;
+    }
+    s->state->min_gain = (uInt) value;
+    return Z_OK;
+  case OPTION_BACKOFF_BLOCKS:
+    if (value < 0) {
+      break;
+    }
+    s->state->backoff_blocks = (uInt) value;
+    s->state->backoff = 0;
+    return Z_OK;
+#ifdef ZFAST_USE_LZ4
+  case OPTION_PAGE_SIZE:
+    if (value != 0 && ( value < ZFAST_PAGE_MIN_SIZE
+                        || (uInt) value > BLOCK_SIZE(s) ) ) {
+      break;
+    }
+    s->state->page_size = (uInt) value;
+    return Z_OK;
+#endif
+  case OPTION_CHECKSUMS:
+    /* the stream information is written along the first block */
+    if (( value & ~( ZFAST_CHECKSUM_BLOCK | ZFAST_CHECKSUM_CONTENT ) ) != 0
+        || s->state->info_done) {
+      break;
+    }
+    s->state->checksums = (uInt) value;
+    return Z_OK;
+  case OPTION_VERIFY_CHECKSUMS:
+    s->state->verify = value != 0;
+    return Z_OK;
+  case OPTION_INDEX:
+    /* every block must be recorded */
+    if (s->state->info_done) {
+      break;
+    }
+    s->state->index = value != 0;
+    return Z_OK;
+  default:
+    break;
+  }
+  s->msg = "invalid option";
+  return Z_STREAM_ERROR;
+}
+
+#ifdef ZFAST_USE_LZ4
+
+/* digest a dictionary for the given level (or ZFAST_LEVEL_DECOMPRESS), using
+   the stream "s" allocator (or the default one if NULL) */
+static zfast_dictionary* fastlzlibDictionaryNew(zfast_stream *s,
+                                                const Bytef *dictionary,
+                                                uInt length, int level) {
+  zfast_dictionary *const dict = (zfast_dictionary*)
+    dict_zalloc(s, sizeof(zfast_dictionary));
+  if (dict == NULL) {
+    return NULL;
   }
+  memset(dict, 0, sizeof(zfast_dictionary));
+  dict->id = (uInt) XXH32(dictionary, length, 0);
+
+  /* only the end of the dictionary can be referenced */
+  if (length > LINKED_WINDOW) {
+    dictionary += length - LINKED_WINDOW;
+    length = LINKED_WINDOW;
+  }
+  dict->size = length;
+  dict->data = dict_zalloc(s, length != 0 ? length : 1);
+  if (dict->data == NULL) {
+    fastlzlibDictionaryFree(s, dict);
+    return NULL;
+  }
+  memcpy(dict->data, dictionary, length);
+
+  /* digest once, to be attached in O(1) to compressing streams */
+  if (level != ZFAST_LEVEL_DECOMPRESS) {
+    dict->lz4 = dict_zalloc(s, sizeof(LZ4_stream_t));
+    if (dict->lz4 == NULL) {
+      fastlzlibDictionaryFree(s, dict);
+      return NULL;
+    }
+    LZ4_initStream(dict->lz4, sizeof(LZ4_stream_t));
+    LZ4_loadDict(dict->lz4, (const char*) dict->data, dict->size);
+    if (lz4_backend_is_hc(level)) {
+      dict->lz4hc = dict_zalloc(s, sizeof(LZ4_streamHC_t));
+      if (dict->lz4hc == NULL) {
+        fastlzlibDictionaryFree(s, dict);
+        return NULL;
+      }
+      LZ4_initStreamHC(dict->lz4hc, sizeof(LZ4_streamHC_t));
+      LZ4_resetStreamHC_fast(dict->lz4hc, lz4_backend_level(level));
+      LZ4_loadDictHC(dict->lz4hc, (const char*) dict->data, dict->size);
+    }
+  }
+
+  return dict;
+}
+
+#endif
+
+zfast_dictionary* fastlzlibCreateDictionary(const void *dictionary,
+                                            uInt length, int level) {
+#ifdef ZFAST_USE_LZ4
+  if (dictionary != NULL || length == 0) {
+    return fastlzlibDictionaryNew(NULL, (const Bytef*) dictionary, length,
+                                  fastlzlibNormalizeLevel(level));
+  }
+#else
+  (void) dictionary;
+  (void) length;
+  (void) level;
 #endif
+  return NULL;
+}
+
+void fastlzlibFreeDictionary(zfast_dictionary *dict) {
+  fastlzlibDictionaryFree(NULL, dict);
+}
+
+int fastlzlibAttachDictionary(zfast_stream *s, const zfast_dictionary *dict) {
+  if (s == NULL || s->state == NULL) {
+    return Z_STREAM_ERROR;
+  }
+#ifdef ZFAST_USE_LZ4
+  if (ZFAST_IS_COMPRESSING(s)) {
+    if (s->state->compressor != COMPRESSOR_LZ4) {
+      s->msg = "dictionaries are only supported by the LZ4 compressor";
+      return Z_VERSION_ERROR;
+    }
+    else if (s->total_in != 0 || s->state->info_done) {
+      s->msg = "dictionary must be set before compressing";
+      return Z_STREAM_ERROR;
+    }
+    else if (dict != NULL && dict->lz4 == NULL) {
+      s->msg = "dictionary was not digested for compression";
+      return Z_STREAM_ERROR;
+    }
+    else if (dict != NULL && lz4_backend_is_hc(s->state->level)
+             && dict->lz4hc == NULL) {
+      s->msg = "dictionary was not digested for this compression level";
+      return Z_STREAM_ERROR;
+    }
+  }
+  else if (dict != NULL && s->state->dict_required
+           && dict->id != s->state->dict_id) {
+    s->msg = "incorrect dictionary";
+    return Z_DATA_ERROR;
+  }
+  s->state->backend.dict = dict;
+  if (dict != NULL) {
+    s->adler = dict->id;
+  }
+  return Z_OK;
+#else
+  (void) dict;
+  s->msg = "dictionaries are not supported";
   return Z_VERSION_ERROR;
+#endif
+}
+
+int fastlzlibSetDictionary(zfast_stream *s, const Bytef *dictionary,
+                           uInt length) {
+#ifdef ZFAST_USE_LZ4
+  zfast_dictionary *dict;
+  int code;
+  if (s == NULL || s->state == NULL || ( dictionary == NULL && length != 0 )) {
+    return Z_STREAM_ERROR;
+  }
+  dict = fastlzlibDictionaryNew(s, dictionary, length, s->state->level);
+  if (dict == NULL) {
+    s->msg = "memory exhausted";
+    return Z_MEM_ERROR;
+  }
+  if ( ( code = fastlzlibAttachDictionary(s, dict) ) != Z_OK) {
+    fastlzlibDictionaryFree(s, dict);
+    return code;
+  }
+  if (s->state->dict != NULL) {
+    fastlzlibDictionaryFree(s, s->state->dict);
+  }
+  s->state->dict = dict;
+  return Z_OK;
+#else
+  (void) dictionary;
+  (void) length;
+  return fastlzlibAttachDictionary(s, NULL);
+#endif
+}
+
+/* dictionary training: the samples are cut into epochs, the best segment of
+   each epoch is selected according to the frequency of its d-mers within the
+   whole corpus, and the best segments are then greedily gathered, each d-mer
+   being only accounted once. */
+
+/* d-mer size (a multiple of the LZ4 minimum match) */
+#define TRAIN_DMER_SIZE          8
+
+/* size of the dictionary segments */
+#define TRAIN_SEGMENT_SIZE     256
+
+/* number of candidate segments per dictionary segment */
+#define TRAIN_CANDIDATES         4
+
+/* d-mer frequency table size (log2) */
+#define TRAIN_FREQ_LOG          20
+#define TRAIN_FREQ_SIZE         ( 1 << TRAIN_FREQ_LOG )
+
+/* maximum number of threads, and minimum amount of samples per thread */
+#define TRAIN_MAX_THREADS       16
+#define TRAIN_MIN_THREAD_SIZE   ( 1 << 20 )
+
+typedef struct zfast_train_segment {
+  uLong score;
+  uInt sample;
+  uInt offset;
+  uInt size;
+} zfast_train_segment;
+
+typedef struct zfast_train_corpus {
+  const Bytef *const *samples;
+  const uInt *sizes;
+  const uLong *starts;   /* offset of each sample within the corpus */
+  uInt count;
+  uLong total;
+  uInt *const *freqs;    /* per-thread d-mer frequencies */
+  int nb_freqs;
+  zfast_train_segment *segments;
+  uLong epoch_size;
+} zfast_train_corpus;
+
+typedef struct zfast_train_job {
+  zfast_train_corpus *corpus;
+  int index;
+  uLong begin;           /* range of the job (bytes, slots, or epochs) */
+  uLong end;
+  void (*run)(struct zfast_train_job *job);
+} zfast_train_job;
+
+static ZFASTINLINE uInt train_hash(const Bytef *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return (uInt) ( ( v * 0x9E3779B185EBCA87ULL ) >> ( 64 - TRAIN_FREQ_LOG ) );
+}
+
+/* index of the sample containing the corpus offset "offs" */
+static uInt train_find_sample(const zfast_train_corpus *c, uLong offs) {
+  uInt lo = 0, hi = c->count;
+  while (hi - lo > 1) {
+    const uInt mid = lo + ( hi - lo ) / 2;
+    if (c->starts[mid] <= offs) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+/* count the d-mers starting within the job range */
+static void train_count(zfast_train_job *job) {
+  const zfast_train_corpus *const c = job->corpus;
+  uInt *const freq = c->freqs[job->index];
+  uInt i;
+  for(i = train_find_sample(c, job->begin) ; i < c->count
+        && c->starts[i] < job->end ; i++) {
+    const Bytef *const data = c->samples[i];
+    const uLong start = c->starts[i];
+    uLong lo = job->begin > start ? job->begin - start : 0;
+    uLong hi = job->end - start;
+    uLong p;
+    if (c->sizes[i] < TRAIN_DMER_SIZE) {
+      continue;
+    }
+    if (hi > c->sizes[i] - TRAIN_DMER_SIZE + 1) {
+      hi = c->sizes[i] - TRAIN_DMER_SIZE + 1;
+    }
+    for(p = lo ; p < hi ; p++) {
+      freq[train_hash(&data[p])]++;
+    }
+  }
+}
+
+/* merge the per-thread frequencies of the job slots into the first table */
+static void train_merge(zfast_train_job *job) {
+  const zfast_train_corpus *const c = job->corpus;
+  uInt *const freq = c->freqs[0];
+  int t;
+  for(t = 1 ; t < c->nb_freqs ; t++) {
+    const uInt *const other = c->freqs[t];
+    uLong h;
+    for(h = job->begin ; h < job->end ; h++) {
+      freq[h] += other[h];
+    }
+  }
+}
+
+/* frequency of the d-mer at "p" ; d-mers seen only once are worthless */
+static ZFASTINLINE uInt train_freq(const uInt *freq, const Bytef *p) {
+  const uInt f = freq[train_hash(p)];
+  return f > 1 ? f : 0;
+}
+
+/* select the best segment of each epoch within the job range */
+static void train_select(zfast_train_job *job) {
+  const zfast_train_corpus *const c = job->corpus;
+  const uInt *const freq = c->freqs[0];
+  uLong e;
+  for(e = job->begin ; e < job->end ; e++) {
+    const uLong begin = e*c->epoch_size;
+    const uLong end = begin + c->epoch_size;
+    zfast_train_segment *const best = &c->segments[e];
+    uInt i;
+    memset(best, 0, sizeof(*best));
+    for(i = train_find_sample(c, begin) ; i < c->count
+          && c->starts[i] < end ; i++) {
+      const Bytef *const data = c->samples[i];
+      const uInt size = c->sizes[i];
+      const uLong start = c->starts[i];
+      const uLong lo = begin > start ? begin - start : 0;
+      const uInt seg = size < TRAIN_SEGMENT_SIZE ? size : TRAIN_SEGMENT_SIZE;
+      uLong hi = end - start;
+      uLong score = 0;
+      uLong p;
+      if (size < TRAIN_DMER_SIZE || lo > size - seg) {
+        continue;
+      }
+      if (hi > size - seg + 1) {
+        hi = size - seg + 1;
+      }
+      /* sliding window of "seg" bytes */
+      for(p = lo ; p < lo + seg - TRAIN_DMER_SIZE + 1 ; p++) {
+        score += train_freq(freq, &data[p]);
+      }
+      for(p = lo ; p < hi ; p++) {
+        if (p != lo) {
+          score += train_freq(freq, &data[p + seg - TRAIN_DMER_SIZE]);
+          score -= train_freq(freq, &data[p - 1]);
+        }
+        if (score > best->score) {
+          best->score = score;
+          best->sample = i;
+          best->offset = (uInt) p;
+          best->size = seg;
+        }
+      }
+    }
+  }
+}
+
+#ifdef ZFAST_USE_THREADS
+static void* train_thread(void *arg) {
+  zfast_train_job *const job = (zfast_train_job*) arg;
+  job->run(job);
+  return NULL;
+}
+#endif
+
+/* run "nb" jobs (in parallel when possible) over the [0, size) range */
+static void train_run(zfast_train_corpus *c, int nb, uLong size,
+                      void (*run)(zfast_train_job *job)) {
+  zfast_train_job jobs[TRAIN_MAX_THREADS];
+#ifdef ZFAST_USE_THREADS
+  pthread_t threads[TRAIN_MAX_THREADS];
+  int started[TRAIN_MAX_THREADS];
+#endif
+  int i;
+  for(i = 0 ; i < nb ; i++) {
+    jobs[i].corpus = c;
+    jobs[i].index = i;
+    jobs[i].begin = size / nb * i;
+    jobs[i].end = i + 1 < nb ? size / nb * ( i + 1 ) : size;
+    jobs[i].run = run;
+  }
+#ifdef ZFAST_USE_THREADS
+  for(i = 1 ; i < nb ; i++) {
+    started[i] = pthread_create(&threads[i], NULL, train_thread,
+                                &jobs[i]) == 0;
+  }
+  run(&jobs[0]);
+  for(i = 1 ; i < nb ; i++) {
+    if (started[i]) {
+      pthread_join(threads[i], NULL);
+    } else {
+      run(&jobs[i]);
+    }
+  }
+#else
+  for(i = 0 ; i < nb ; i++) {
+    run(&jobs[i]);
+  }
+#endif
+}
+
+/* score of a segment, given the current d-mer frequencies, each d-mer being
+   accounted once ; the d-mers are then forgotten if "commit" is set */
+static uLong train_rescore(uInt *freq, const zfast_train_corpus *c,
+                           const zfast_train_segment *seg, uInt *saved,
+                           int commit) {
+  const Bytef *const data = &c->samples[seg->sample][seg->offset];
+  uLong score = 0;
+  uInt nb = 0;
+  uInt p;
+  for(p = 0 ; p + TRAIN_DMER_SIZE <= seg->size ; p++) {
+    const uInt h = train_hash(&data[p]);
+    if (freq[h] > 1) {
+      score += freq[h];
+      saved[2*nb] = h;
+      saved[2*nb + 1] = freq[h];
+      nb++;
+      freq[h] = 0;
+    }
+  }
+  if (!commit) {
+    while(nb-- != 0) {
+      freq[saved[2*nb]] = saved[2*nb + 1];
+    }
+  }
+  return score;
+}
+
+/* max-heap of candidate segments, sorted by score */
+static void train_heap_down(zfast_train_segment *heap, uInt size, uInt i) {
+  for(;;) {
+    uInt best = i;
+    const uInt left = 2*i + 1, right = 2*i + 2;
+    if (left < size && heap[left].score > heap[best].score) {
+      best = left;
+    }
+    if (right < size && heap[right].score > heap[best].score) {
+      best = right;
+    }
+    if (best == i) {
+      break;
+    } else {
+      const zfast_train_segment tmp = heap[i];
+      heap[i] = heap[best];
+      heap[best] = tmp;
+      i = best;
+    }
+  }
+}
+
+static int train_threads(uLong total) {
+  int nb = 1;
+#ifdef ZFAST_USE_THREADS
+  const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  nb = cpus > 0 ? (int) cpus : 1;
+  if (nb > TRAIN_MAX_THREADS) {
+    nb = TRAIN_MAX_THREADS;
+  }
+  if ((uLong) nb > total / TRAIN_MIN_THREAD_SIZE + 1) {
+    nb = (int) ( total / TRAIN_MIN_THREAD_SIZE + 1 );
+  }
+#else
+  (void) total;
+#endif
+  return nb;
+}
+
+int fastlzlibTrainDictionary(const void *const *samples, const uInt *sizes,
+                             uInt n, void *dictionary, uInt capacity) {
+  Bytef *const dict = (Bytef*) dictionary;
+  zfast_train_corpus corpus;
+  uInt *freqs[TRAIN_MAX_THREADS];
+  uLong *starts = NULL;
+  zfast_train_segment *heap = NULL;
+  uInt *saved = NULL;
+  uLong nb_epochs;
+  uInt heap_size;
+  uInt pos;
+  uInt i;
+  int nb_threads;
+  int t;
+  int code;
+
+  if (( samples == NULL || sizes == NULL ) && n != 0) {
+    return Z_STREAM_ERROR;
+  }
+  if (dict == NULL && capacity != 0) {
+    return Z_STREAM_ERROR;
+  }
+  /* only the last 64KB of a dictionary are used */
+  if (capacity > LINKED_WINDOW) {
+    capacity = LINKED_WINDOW;
+  }
+
+  memset(&corpus, 0, sizeof(corpus));
+  corpus.samples = (const Bytef *const *) samples;
+  corpus.sizes = sizes;
+  corpus.count = n;
+  for(i = 0 ; i < n ; i++) {
+    corpus.total += sizes[i];
+  }
+
+  /* small corpus: the samples are the dictionary */
+  if (corpus.total <= capacity) {
+    for(i = 0, pos = 0 ; i < n ; i++) {
+      memcpy(&dict[pos], samples[i], sizes[i]);
+      pos += sizes[i];
+    }
+    return (int) pos;
+  }
+
+  nb_threads = train_threads(corpus.total);
+  memset(freqs, 0, sizeof(freqs));
+  nb_epochs = capacity / TRAIN_SEGMENT_SIZE * TRAIN_CANDIDATES;
+  if (nb_epochs > corpus.total / TRAIN_SEGMENT_SIZE) {
+    nb_epochs = corpus.total / TRAIN_SEGMENT_SIZE;
+  }
+  if (nb_epochs == 0) {
+    nb_epochs = 1;
+  }
+  corpus.epoch_size = ( corpus.total + nb_epochs - 1 ) / nb_epochs;
+  corpus.freqs = freqs;
+  corpus.nb_freqs = nb_threads;
+
+  code = Z_MEM_ERROR;
+  starts = (uLong*) malloc(n*sizeof(uLong));
+  corpus.segments = (zfast_train_segment*)
+    malloc(nb_epochs*sizeof(zfast_train_segment));
+  saved = (uInt*) malloc(2*TRAIN_SEGMENT_SIZE*sizeof(uInt));
+  if (starts == NULL || corpus.segments == NULL || saved == NULL) {
+    goto done;
+  }
+  for(t = 0 ; t < nb_threads ; t++) {
+    freqs[t] = (uInt*) calloc(TRAIN_FREQ_SIZE, sizeof(uInt));
+    if (freqs[t] == NULL) {
+      goto done;
+    }
+  }
+  for(i = 0 ; i < n ; i++) {
+    starts[i] = i != 0 ? starts[i - 1] + sizes[i - 1] : 0;
+  }
+  corpus.starts = starts;
+
+  /* d-mer frequencies, and best segment of each epoch */
+  train_run(&corpus, nb_threads, corpus.total, train_count);
+  train_run(&corpus, nb_threads, TRAIN_FREQ_SIZE, train_merge);
+  train_run(&corpus, nb_threads, nb_epochs, train_select);
+
+  /* greedy selection, with lazy rescoring (scores can only decrease) ; the
+     best segments are placed at the end of the dictionary, closest to the
+     compressed data */
+  heap = corpus.segments;
+  for(i = 0, heap_size = 0 ; i < nb_epochs ; i++) {
+    if (heap[i].score != 0) {
+      heap[heap_size++] = heap[i];
+    }
+  }
+  for(i = heap_size / 2 ; i-- != 0 ; ) {
+    train_heap_down(heap, heap_size, i);
+  }
+  pos = capacity;
+  while(heap_size != 0 && pos != 0) {
+    zfast_train_segment *const top = &heap[0];
+    top->score = train_rescore(freqs[0], &corpus, top, saved, 0);
+    if (top->score == 0) {
+      heap[0] = heap[--heap_size];
+    } else if (( heap_size < 2 || top->score >= heap[1].score )
+               && ( heap_size < 3 || top->score >= heap[2].score )) {
+      const uInt size = top->size < pos ? top->size : pos;
+      train_rescore(freqs[0], &corpus, top, saved, 1);
+      pos -= size;
+      memcpy(&dict[pos], &corpus.samples[top->sample][top->offset], size);
+      heap[0] = heap[--heap_size];
+    }
+    train_heap_down(heap, heap_size, 0);
+  }
+
+  /* dictionary not filled */
+  if (pos != 0) {
+    memmove(dict, &dict[pos], capacity - pos);
+  }
+  code = (int) ( capacity - pos );
+
+ done:
+  for(t = 0 ; t < nb_threads ; t++) {
+    free(freqs[t]);
+  }
+  free(saved);
+  free(corpus.segments);
+  free(starts);
+  return code;
 }
 
 int fastlzlibCompressEnd(zfast_stream *s) {
@@ -459,23 +2028,502 @@ int fastlzlibCompressReset(zfast_stream *s) {
   if (s == NULL) {
     return Z_STREAM_ERROR;
   }
-  fastlzlibReset(s);
-  return Z_OK;
+  fastlzlibReset(s);
+  return Z_OK;
+}
+
+int fastlzlibDecompressReset(zfast_stream *s) {
+  return fastlzlibCompressReset(s);
+}
+
+int fastlzlibCompressMemory(zfast_stream *s) {
+  if (s == NULL || s->state == NULL) {
+    return -1;
+  }
+  return (int) ( sizeof(zfast_stream_internal)
+                 + s->state->outBuffSize
+                 + ( s->state->inBuff != NULL ? INPUT_BUFFER_SIZE(s) : 0 )
+                 + ( s->state->indexBuff != NULL
+                     ? INDEX_TRAILER_SIZE(s->state->indexCapacity) : 0 )
+                 + fastlzlibBackendMemory(s) + s->state->histSize );
+}
+
+int fastlzlibDecompressMemory(zfast_stream *s) {
+  return fastlzlibCompressMemory(s);
+}
+
+int fastlzlibSetAllocator(zfast_stream *s, const zfast_allocator *allocator) {
+  zfast_stream_internal *state;
+  if (s == NULL || s->state == NULL || allocator == NULL
+      || allocator->allocate == NULL || allocator->deallocate == NULL) {
+    return Z_STREAM_ERROR;
+  }
+  /* only the state may have been allocated so far */
+  if (fastlzlibCompressMemory(s) != (int) sizeof(zfast_stream_internal)
+      || s->state->dict != NULL) {
+    s->msg = "allocator must be set before processing";
+    return Z_STREAM_ERROR;
+  }
+  /* move the state to the new allocator */
+  state = (zfast_stream_internal*)
+    allocator->allocate(allocator->opaque, sizeof(zfast_stream_internal),
+                        ALLOC_ALIGNMENT, ZFAST_ALLOC_CONTEXT);
+  if (state == NULL) {
+    s->msg = "memory exhausted";
+    return Z_MEM_ERROR;
+  }
+  memcpy(state, s->state, sizeof(zfast_stream_internal));
+  /* built-in backends use the backend context, and client-defined ones
+     without context (fastlzlibSetCompress()) the state itself */
+  if (state->compress_ctx == &s->state->backend) {
+    state->compress_ctx = &state->backend;
+  } else if (state->compress_ctx == s->state) {
+    state->compress_ctx = state;
+  }
+  if (state->decompress_ctx == &s->state->backend) {
+    state->decompress_ctx = &state->backend;
+  } else if (state->decompress_ctx == s->state) {
+    state->decompress_ctx = state;
+  }
+  buff_zfree(s, s->state, sizeof(zfast_stream_internal));
+  state->allocator = *allocator;
+  s->state = state;
+  return Z_OK;
+}
+
+/* built-in allocator: huge pages for large blocks (pre-faulted if "opaque"
+   is not NULL), aligned heap memory otherwise */
+static void* huge_page_allocate(void *opaque, size_t size, size_t alignment,
+                                int hint) {
+  void *address = NULL;
+#ifdef __linux__
+  if (size >= HUGE_PAGE_SIZE) {
+    /* map an extra huge page, and trim the mapping on huge page
+       boundaries */
+    const size_t length = ( size + HUGE_PAGE_SIZE - 1 )
+      & ~( (size_t) HUGE_PAGE_SIZE - 1 );
+    Bytef *const map = (Bytef*) mmap(NULL, length + HUGE_PAGE_SIZE,
+                                     PROT_READ | PROT_WRITE,
+                                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    size_t head;
+    if (map == MAP_FAILED) {
+      return NULL;
+    }
+    head = ( HUGE_PAGE_SIZE - ( (uintptr_t) map & ( HUGE_PAGE_SIZE - 1 ) ) )
+      & ( HUGE_PAGE_SIZE - 1 );
+    if (head != 0) {
+      munmap(map, head);
+    }
+    munmap(&map[head + length], HUGE_PAGE_SIZE - head);
+    address = &map[head];
+    /* transparent huge pages are only a hint */
+    (void) madvise(address, length, MADV_HUGEPAGE);
+    /* touch each page, so that the first blocks do not page fault */
+    if (opaque != NULL && hint == ZFAST_ALLOC_BUFFER) {
+      volatile Bytef *const data = (volatile Bytef*) address;
+      size_t i;
+      for(i = 0 ; i < length ; i += 4096) {
+        data[i] = 0;
+      }
+    }
+    return address;
+  }
+#else
+  (void) opaque;
+  (void) hint;
+#endif
+#ifdef _WIN32
+  address = _aligned_malloc(size, alignment);
+#else
+  if (posix_memalign(&address, alignment, size) != 0) {
+    address = NULL;
+  }
+#endif
+  return address;
+}
+
+static void huge_page_deallocate(void *opaque, void *address, size_t size,
+                                 size_t alignment) {
+  (void) opaque;
+  (void) alignment;
+#ifdef __linux__
+  if (size >= HUGE_PAGE_SIZE) {
+    munmap(address, ( size + HUGE_PAGE_SIZE - 1 )
+           & ~( (size_t) HUGE_PAGE_SIZE - 1 ));
+    return;
+  }
+#else
+  (void) size;
+#endif
+#ifdef _WIN32
+  _aligned_free(address);
+#else
+  free(address);
+#endif
+}
+
+/* "opaque" of the pre-faulting allocator */
+static char huge_page_prefault;
+
+static const zfast_allocator huge_page_allocator = {
+  huge_page_allocate, huge_page_deallocate, NULL
+};
+
+static const zfast_allocator huge_page_allocator_prefault = {
+  huge_page_allocate, huge_page_deallocate, &huge_page_prefault
+};
+
+const zfast_allocator* fastlzlibGetHugePageAllocator(int prefault) {
+  return prefault ? &huge_page_allocator_prefault : &huge_page_allocator;
+}
+
+uLong fastlzlibCompressBound(zfast_stream *s, uLong length, int flush) {
+  const zfast_stream *const bs = s != NULL && s->state != NULL ? s : NULL;
+  const uInt block_size = bs != NULL ? BLOCK_SIZE(bs) : DEFAULT_BLOCK_SIZE;
+  uLong bound = 0;
+  if (bs != NULL) {
+    if (!ZFAST_IS_COMPRESSING(bs)) {
+      return 0;
+    }
+    /* buffered input is written along */
+    length += bs->state->inBuffOffs;
+    /* each page holds at least its size minus the stream information, the
+       block header and checksum, the end of stream, and two padding blocks
+       (one preceding the EOF marker) ; the last page, and the one holding
+       the EOF marker, may be partial */
+    if (ZFAST_IS_PAGED(bs)) {
+      const uLong page_size = bs->state->page_size;
+      const uLong page_min = page_size - INFO_MAX_SIZE - HEADER_SIZE
+        - ZFAST_BLOCK_CHECKSUM_SIZE(bs->state->checksums)
+        - ZFAST_EOF_SIZE(bs->state->checksums) - 2*PADDING_MIN_SIZE;
+      const uLong pages = length / page_min + 2;
+      return pages * page_size
+        + ( flush == Z_FINISH && bs->state->index
+            ? INDEX_TRAILER_SIZE(bs->state->index_count + pages) : 0 );
+    }
+  }
+  if (length != 0) {
+    if (bs == NULL || !bs->state->info_done) {
+      bound += INFO_MAX_SIZE;
+    }
+    bound += ( length / block_size )
+      * fastlzlibBlockBound(bs, block_size);
+    if (length % block_size != 0) {
+      bound += fastlzlibBlockBound(bs, (uInt) ( length % block_size ));
+    }
+  }
+  if (flush == Z_FINISH) {
+    bound += bs != NULL ? ZFAST_EOF_SIZE(bs->state->checksums) : HEADER_SIZE;
+    /* seek index: the recorded blocks, and at most one per block to come */
+    if (bs != NULL && bs->state->index) {
+      bound += INDEX_TRAILER_SIZE(bs->state->index_count
+                                  + ( length + block_size - 1 ) / block_size);
+    }
+  }
+  return bound;
+}
+
+/* pooled stream, and next free one */
+typedef struct zfast_pool_entry {
+  zfast_stream stream;
+  struct zfast_pool_entry *next;
+} zfast_pool_entry;
+
+#ifdef ZFAST_USE_THREADS
+/* free streams kept by a thread for a pool, registered in the pool until the
+   thread exits or the pool is destroyed ("pool" is then NULL) */
+typedef struct zfast_pool_cache {
+  /* identifier of the pool (never reused), and the pool while alive */
+  uint64_t id;
+  zfast_pool *pool;
+  zfast_pool_entry *free;
+  uInt count;
+  /* caches of the pool */
+  struct zfast_pool_cache *prev;
+  struct zfast_pool_cache *next;
+  /* caches of the thread, only changed by the thread itself */
+  struct zfast_pool_cache *thread_next;
+} zfast_pool_cache;
+
+/* caches of all pools of a thread, value of the key shared by all pools
+   (which is never deleted, so that a pool can be destroyed while threads
+   are exiting) ; the links between threads and pools are protected by
+   pool_threads_lock */
+static pthread_key_t pool_key;
+static int pool_key_valid = 0;
+static pthread_mutex_t pool_threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t pool_next_id = 0;
+#endif
+
+struct zfast_pool {
+  /* level (or ZFAST_POOL_DECOMPRESS), block size and compressor of the
+     streams */
+  int level;
+  int block_size;
+  zfast_stream_compressor compressor;
+  /* free streams shared by all threads */
+  zfast_pool_entry *free;
+#if defined(ZFAST_USE_THREADS)
+  pthread_mutex_t lock;
+  /* identifier, and per-thread free streams (zfast_pool_cache) */
+  uint64_t id;
+  zfast_pool_cache *caches;
+#elif defined(_WIN32)
+  CRITICAL_SECTION lock;
+#endif
+};
+
+#if defined(ZFAST_USE_THREADS)
+#define POOL_LOCK(P) pthread_mutex_lock(&(P)->lock)
+#define POOL_UNLOCK(P) pthread_mutex_unlock(&(P)->lock)
+#elif defined(_WIN32)
+#define POOL_LOCK(P) EnterCriticalSection(&(P)->lock)
+#define POOL_UNLOCK(P) LeaveCriticalSection(&(P)->lock)
+#else
+#define POOL_LOCK(P) (void) (P)
+#define POOL_UNLOCK(P) (void) (P)
+#endif
+
+/* free a list of pooled streams */
+static void fastlzlibPoolFreeList(zfast_pool_entry *e) {
+  while(e != NULL) {
+    zfast_pool_entry *const next = e->next;
+    fastlzlibFree(&e->stream);
+    default_zfree(e);
+    e = next;
+  }
+}
+
+#ifdef ZFAST_USE_THREADS
+/* thread exit: give the cached streams back to their pools */
+static void fastlzlibPoolThreadExit(void *arg) {
+  zfast_pool_cache *cache = (zfast_pool_cache*) arg;
+  pthread_mutex_lock(&pool_threads_lock);
+  while(cache != NULL) {
+    zfast_pool_cache *const next = cache->thread_next;
+    zfast_pool *const pool = cache->pool;
+    if (pool != NULL) {
+      POOL_LOCK(pool);
+      while(cache->free != NULL) {
+        zfast_pool_entry *const e = cache->free;
+        cache->free = e->next;
+        e->next = pool->free;
+        pool->free = e;
+      }
+      POOL_UNLOCK(pool);
+      if (cache->prev != NULL) {
+        cache->prev->next = cache->next;
+      } else {
+        pool->caches = cache->next;
+      }
+      if (cache->next != NULL) {
+        cache->next->prev = cache->prev;
+      }
+    }
+    default_zfree(cache);
+    cache = next;
+  }
+  pthread_mutex_unlock(&pool_threads_lock);
+}
+
+/* create the key shared by all pools */
+static void fastlzlibPoolKeyCreate(void) {
+  pool_key_valid = pthread_key_create(&pool_key, fastlzlibPoolThreadExit)
+    == 0;
+}
+
+/* cache of the calling thread, created if "create" is set (NULL upon
+   memory allocation error) ; the most recently created cache comes first */
+static zfast_pool_cache* fastlzlibPoolCache(zfast_pool *pool, int create) {
+  zfast_pool_cache *const head =
+    (zfast_pool_cache*) pthread_getspecific(pool_key);
+  zfast_pool_cache *cache;
+  zfast_pool_cache **link;
+  /* caches of destroyed pools never match, their identifier being unique */
+  for(cache = head ; cache != NULL && cache->id != pool->id
+        ; cache = cache->thread_next) ;
+  if (cache != NULL || !create) {
+    return cache;
+  }
+  cache = (zfast_pool_cache*) default_zalloc(sizeof(zfast_pool_cache), 1);
+  if (cache == NULL) {
+    return NULL;
+  }
+  memset(cache, 0, sizeof(zfast_pool_cache));
+  cache->id = pool->id;
+  cache->pool = pool;
+  cache->thread_next = head;
+  if (pthread_setspecific(pool_key, cache) != 0) {
+    default_zfree(cache);
+    return NULL;
+  }
+  pthread_mutex_lock(&pool_threads_lock);
+  /* drop the caches of destroyed pools */
+  for(link = &cache->thread_next ; *link != NULL ; ) {
+    zfast_pool_cache *const c = *link;
+    if (c->pool == NULL) {
+      *link = c->thread_next;
+      default_zfree(c);
+    } else {
+      link = &c->thread_next;
+    }
+  }
+  cache->next = pool->caches;
+  if (cache->next != NULL) {
+    cache->next->prev = cache;
+  }
+  pool->caches = cache;
+  pthread_mutex_unlock(&pool_threads_lock);
+  return cache;
+}
+#endif
+
+/* restore the defaults of a released stream, keeping its buffers and
+   backend contexts */
+static void fastlzlibPoolRecycle(const zfast_pool *pool, zfast_stream *s) {
+  fastlzlibReset(s);
+  if (s->state->dict != NULL) {
+    fastlzlibDictionaryFree(s, s->state->dict);
+    s->state->dict = NULL;
+  }
+  s->state->backend.dict = NULL;
+  s->state->index_table = NULL;
+  fastlzlibDefaults(s);
+  (void) fastlzlibSetCompressor(s, pool->compressor);
+  s->next_in = NULL;
+  s->avail_in = 0;
+  s->next_out = NULL;
+  s->avail_out = 0;
+  s->adler = 0;
+}
+
+zfast_pool* fastlzlibPoolCreate(int level, int block_size,
+                                zfast_stream_compressor compressor) {
+  zfast_pool *pool;
+  if (fastlzlibGetBlockSizeLevel(block_size) == -1) {
+    return NULL;
+  }
+  pool = (zfast_pool*) default_zalloc(sizeof(zfast_pool), 1);
+  if (pool == NULL) {
+    return NULL;
+  }
+  memset(pool, 0, sizeof(zfast_pool));
+  pool->level = level == ZFAST_POOL_DECOMPRESS
+    ? level : fastlzlibNormalizeLevel(level);
+  pool->block_size = block_size;
+  pool->compressor = compressor;
+#if defined(ZFAST_USE_THREADS)
+  {
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, fastlzlibPoolKeyCreate);
+  }
+  if (!pool_key_valid || pthread_mutex_init(&pool->lock, NULL) != 0) {
+    default_zfree(pool);
+    return NULL;
+  }
+  pthread_mutex_lock(&pool_threads_lock);
+  pool->id = ++pool_next_id;
+  pthread_mutex_unlock(&pool_threads_lock);
+#elif defined(_WIN32)
+  InitializeCriticalSection(&pool->lock);
+#endif
+  return pool;
 }
 
-int fastlzlibDecompressReset(zfast_stream *s) {
-  return fastlzlibCompressReset(s);
+zfast_stream* fastlzlibPoolAcquire(zfast_pool *pool) {
+  zfast_pool_entry *e;
+  int code;
+  if (pool == NULL) {
+    return NULL;
+  }
+#ifdef ZFAST_USE_THREADS
+  /* fast path: a stream released by this thread */
+  {
+    zfast_pool_cache *const cache = fastlzlibPoolCache(pool, 0);
+    if (cache != NULL && cache->free != NULL) {
+      e = cache->free;
+      cache->free = e->next;
+      cache->count--;
+      return &e->stream;
+    }
+  }
+#endif
+  POOL_LOCK(pool);
+  e = pool->free;
+  if (e != NULL) {
+    pool->free = e->next;
+  }
+  POOL_UNLOCK(pool);
+  if (e != NULL) {
+    return &e->stream;
+  }
+  /* new stream */
+  e = (zfast_pool_entry*) default_zalloc(sizeof(zfast_pool_entry), 1);
+  if (e == NULL) {
+    return NULL;
+  }
+  memset(e, 0, sizeof(zfast_pool_entry));
+  code = pool->level == ZFAST_POOL_DECOMPRESS
+    ? fastlzlibDecompressInit2(&e->stream, pool->block_size)
+    : fastlzlibCompressInit2(&e->stream, pool->level, pool->block_size);
+  if (code == Z_OK) {
+    code = fastlzlibSetCompressor(&e->stream, pool->compressor);
+  }
+  if (code != Z_OK) {
+    fastlzlibFree(&e->stream);
+    default_zfree(e);
+    return NULL;
+  }
+  return &e->stream;
 }
 
-int fastlzlibCompressMemory(zfast_stream *s) {
-  if (s == NULL || s->state == NULL) {
-    return -1;
+void fastlzlibPoolRelease(zfast_pool *pool, zfast_stream *s) {
+  zfast_pool_entry *const e = (zfast_pool_entry*) s;
+  if (pool == NULL || s == NULL) {
+    return;
+  }
+  fastlzlibPoolRecycle(pool, s);
+#ifdef ZFAST_USE_THREADS
+  /* fast path: kept by this thread */
+  {
+    zfast_pool_cache *const cache = fastlzlibPoolCache(pool, 1);
+    if (cache != NULL && cache->count < POOL_CACHE_SIZE) {
+      e->next = cache->free;
+      cache->free = e;
+      cache->count++;
+      return;
+    }
   }
-  return (int) ( sizeof(zfast_stream_internal) + BUFFER_BLOCK_SIZE(s) * 2 );
+#endif
+  POOL_LOCK(pool);
+  e->next = pool->free;
+  pool->free = e;
+  POOL_UNLOCK(pool);
 }
 
-int fastlzlibDecompressMemory(zfast_stream *s) {
-  return fastlzlibCompressMemory(s);
+void fastlzlibPoolDestroy(zfast_pool *pool) {
+  if (pool == NULL) {
+    return;
+  }
+#if defined(ZFAST_USE_THREADS)
+  /* the caches are detached from the pool, and freed by their thread
+     (threads exiting meanwhile wait for the lock) */
+  pthread_mutex_lock(&pool_threads_lock);
+  while(pool->caches != NULL) {
+    zfast_pool_cache *const cache = pool->caches;
+    pool->caches = cache->next;
+    fastlzlibPoolFreeList(cache->free);
+    cache->free = NULL;
+    cache->count = 0;
+    cache->pool = NULL;
+  }
+  pthread_mutex_unlock(&pool_threads_lock);
+  pthread_mutex_destroy(&pool->lock);
+#elif defined(_WIN32)
+  DeleteCriticalSection(&pool->lock);
+#endif
+  fastlzlibPoolFreeList(pool->free);
+  default_zfree(pool);
 }
 
 static ZFASTINLINE void inSeek(zfast_stream *s, uInt offs) {
@@ -531,91 +2579,1173 @@ static ZFASTINLINE void fastlz_read_header(const Bytef* source,
   }
 }
 
-int fastlzlibGetStreamBlockSize(const void* input, int length) {
-  uInt block_size = 0;
-  if (length >= HEADER_SIZE) {
-    uInt block_type;
-    uInt str_size;
-    uInt dec_size;
-    fastlz_read_header((const Bytef*) input, &block_type, &block_size,
-                       &str_size, &dec_size);
+/* plausible header of an independent block, when resynchronizing: magic,
+   sizes within the block size, and sizes consistent with the block type
+   (linked blocks need the history of the previous ones) ; the checksum of
+   the candidate block is verified if it is entirely within "length" bytes */
+static int fastlz_is_sync_header(const zfast_stream *const s,
+                                 const Bytef* source, uInt length) {
+  const uInt checksum_size = ZFAST_BLOCK_CHECKSUM_SIZE(s->state->flags);
+  uInt block_type;
+  uInt block_size;
+  uInt str_size;
+  uInt dec_size;
+  int plausible;
+  fastlz_read_header(source, &block_type, &block_size, &str_size, &dec_size);
+  if (block_type == BLOCK_TYPE_BAD_MAGIC
+      || str_size > block_size + checksum_size || dec_size > block_size) {
+    return 0;
+  }
+  switch(block_type) {
+  case BLOCK_TYPE_INFO:
+    return dec_size == 0 && str_size <= block_size;
+  case BLOCK_TYPE_RAW:
+    plausible = str_size == dec_size + checksum_size;
+    break;
+  case BLOCK_TYPE_COMPRESSED:
+  case BLOCK_TYPE_FASTLZ:
+  case BLOCK_TYPE_LZ4:
+  case BLOCK_TYPE_LZFSE:
+  case BLOCK_TYPE_KEYFRAME:
+    /* empty only for the EOF marker */
+    if (str_size == 0 && dec_size == 0) {
+      return 1;
+    }
+    plausible = str_size > checksum_size && dec_size != 0;
+    break;
+  default:
+    return 0;
+  }
+  if (plausible && checksum_size != 0 && length >= HEADER_SIZE + str_size) {
+    const Bytef *const data = &source[HEADER_SIZE];
+    const uInt size = str_size - checksum_size;
+    return (uInt) XXH32(data, size, 0) == READ_32(&data[size]);
+  }
+  return plausible;
+}
+
+int fastlzlibGetStreamBlockSize(const void* input, int length) {
+  uInt block_size = 0;
+  if (length >= HEADER_SIZE) {
+    uInt block_type;
+    uInt str_size;
+    uInt dec_size;
+    fastlz_read_header((const Bytef*) input, &block_type, &block_size,
+                       &str_size, &dec_size);
+  }
+  return block_size;
+}
+
+int fastlzlibGetStreamInfo(const void* input, int length,
+                           uInt *compressed_size,
+                           uInt *uncompressed_size) {
+  if (input != NULL && compressed_size != NULL && uncompressed_size != NULL) {
+    if (length >= HEADER_SIZE) {
+      uInt block_size = 0;
+      uInt block_type;
+      fastlz_read_header((const Bytef*) input, &block_type, &block_size,
+                         compressed_size, uncompressed_size);
+      if (block_size != 0) {
+        return Z_OK;
+      } else {
+        return Z_DATA_ERROR;
+      }
+    } else {
+      return Z_BUF_ERROR;
+    }
+  } else {
+    return Z_STREAM_ERROR;
+  }
+}
+
+int fastlzlibGetBlockChecksums(const void* input, int length,
+                               int *flags, uInt *block_checksum,
+                               Bytef content_checksum[8]) {
+  const Bytef *const in = (const Bytef*) input;
+  const Bytef *const data = &in[HEADER_SIZE];
+  uInt block_type;
+  uInt block_size;
+  uInt str_size;
+  uInt dec_size;
+  int found = 0;
+  if (input == NULL || flags == NULL || block_checksum == NULL
+      || content_checksum == NULL) {
+    return Z_STREAM_ERROR;
+  }
+  if (length < HEADER_SIZE) {
+    return Z_BUF_ERROR;
+  }
+  fastlz_read_header(in, &block_type, &block_size, &str_size, &dec_size);
+  if (block_type == BLOCK_TYPE_BAD_MAGIC) {
+    return Z_DATA_ERROR;
+  }
+  if ((uInt) length - HEADER_SIZE < str_size) {
+    return Z_BUF_ERROR;
+  }
+  /* stream information records */
+  if (block_type == BLOCK_TYPE_INFO) {
+    uInt i;
+    for(i = 0 ; i + 2 <= str_size ; ) {
+      const uInt tag = data[i];
+      const uInt len = data[i + 1];
+      const Bytef *const value = &data[i + 2];
+      if (i + 2 + len > str_size) {
+        return Z_DATA_ERROR;
+      }
+      if (tag == INFO_FLAGS && len == 1) {
+        *flags = value[0];
+      } else if (tag == INFO_CONTENT_CHECKSUM && len == 8) {
+        /* little endian in the stream */
+        uInt j;
+        for(j = 0 ; j < 8 ; j++) {
+          content_checksum[j] = value[7 - j];
+        }
+        found |= ZFAST_CHECKSUM_CONTENT;
+      }
+      i += 2 + len;
+    }
+  }
+  /* checksum following the stored data (not of the seek index) */
+  else if (( *flags & ZFAST_CHECKSUM_BLOCK ) != 0
+           && block_type != BLOCK_TYPE_INDEX
+           && str_size >= BLOCK_CHECKSUM_SIZE) {
+    *block_checksum = READ_32(&data[str_size - BLOCK_CHECKSUM_SIZE]);
+    found |= ZFAST_CHECKSUM_BLOCK;
+  }
+  return found;
+}
+
+#ifdef ZFAST_USE_LZ4
+
+/* allocate the history buffer of linked blocks */
+static int fastlzlibHistoryAlloc(zfast_stream *s, uInt size) {
+  if (s->state->histBuff == NULL) {
+    s->state->histBuff = buff_zalloc(s, size, ZFAST_ALLOC_BUFFER);
+    if (s->state->histBuff == NULL) {
+      return Z_MEM_ERROR;
+    }
+    s->state->histSize = size;
+    s->state->histOffs = 0;
+  }
+  assert(s->state->histSize >= size);
+  return Z_OK;
+}
+
+/* append decompressed data to the history (the last LINKED_WINDOW bytes are
+   kept contiguous) */
+static void fastlzlibHistoryAppend(zfast_stream *s, const Bytef *data,
+                                   uInt size) {
+  zfast_stream_internal *const state = s->state;
+  assert(state->histSize >= LINKED_WINDOW*2);
+  if (size >= LINKED_WINDOW) {
+    memcpy(state->histBuff, &data[size - LINKED_WINDOW], LINKED_WINDOW);
+    state->histOffs = LINKED_WINDOW;
+  } else {
+    if (state->histOffs + size > state->histSize) {
+      memmove(state->histBuff, &state->histBuff[state->histOffs - LINKED_WINDOW],
+              LINKED_WINDOW);
+      state->histOffs = LINKED_WINDOW;
+    }
+    memcpy(&state->histBuff[state->histOffs], data, size);
+    state->histOffs += size;
+  }
+}
+
+/* compress a linked LZ4 block ; the data is first appended to the history so
+   that the previous LINKED_WINDOW bytes are contiguous. Returns the compressed
+   size, or 0 upon error (in which case the chain is broken) */
+static int lz4_linked_compress(zfast_stream *s, int keyframe, int level,
+                               const void* input, int length,
+                               void* output, int maxout) {
+  zfast_stream_internal *const state = s->state;
+  zfast_backend_ctx *const backend = &state->backend;
+  const int lz4Level = lz4_backend_level(level);
+  char *dest;
+
+  if (fastlzlibHistoryAlloc(s, LINKED_WINDOW + BLOCK_SIZE(s)) != Z_OK) {
+    return 0;
+  }
+
+  /* start a new chain, using the preset dictionary if any */
+  if (keyframe) {
+    if (lz4Level > 0) {
+      LZ4_resetStreamHC_fast(backend->lz4hc, lz4Level);
+      if (backend->dict != NULL) {
+        LZ4_attach_HC_dictionary(backend->lz4hc, backend->dict->lz4hc);
+      }
+    } else {
+      LZ4_resetStream_fast(backend->lz4);
+      if (backend->dict != NULL) {
+        LZ4_attach_dictionary(backend->lz4, backend->dict->lz4);
+      }
+    }
+    state->histOffs = 0;
+  }
+  /* slide the window */
+  else if (state->histOffs + length > state->histSize) {
+    state->histOffs = lz4Level > 0
+      ? LZ4_saveDictHC(backend->lz4hc, (char*) state->histBuff, LINKED_WINDOW)
+      : LZ4_saveDict(backend->lz4, (char*) state->histBuff, LINKED_WINDOW);
+  }
+
+  dest = (char*) &state->histBuff[state->histOffs];
+  memcpy(dest, input, length);
+  state->histOffs += length;
+  if (lz4Level > 0) {
+    return LZ4_compress_HC_continue(backend->lz4hc, dest, output, length,
+                                    maxout);
+  }
+  return LZ4_compress_fast_continue(backend->lz4, dest, output, length, maxout,
+                                    -lz4Level);
+}
+
+/* decompress a keyframe LZ4 block (using the preset dictionary if any), and
+   start a new history */
+static int lz4_keyframe_decompress(zfast_stream *s, const void* input,
+                                   int length, void* output, int maxout) {
+  zfast_stream_internal *const state = s->state;
+  const int done = lz4_backend_decompress(&state->backend, input, length,
+                                          output, maxout);
+  state->histOffs = 0;
+  state->histDict = state->backend.dict != NULL;
+  if (done > 0) {
+    fastlzlibHistoryAppend(s, output, done);
+  }
+  return done;
+}
+
+/* decompress a linked LZ4 block, and update the history */
+static int lz4_linked_decompress(zfast_stream *s, const void* input,
+                                 int length, void* output, int maxout) {
+  zfast_stream_internal *const state = s->state;
+  uInt dict_size;
+  int done;
+
+  /* the chain is still within the preset dictionary window: prepend it */
+  if (state->histDict) {
+    const zfast_dictionary *const dict = state->backend.dict;
+    if (dict != NULL && state->histOffs < LINKED_WINDOW) {
+      uInt size = LINKED_WINDOW - state->histOffs;
+      if (size > dict->size) {
+        size = dict->size;
+      }
+      memmove(&state->histBuff[size], state->histBuff, state->histOffs);
+      memcpy(state->histBuff, &dict->data[dict->size - size], size);
+      state->histOffs += size;
+    }
+    state->histDict = 0;
+  }
+
+  dict_size = state->histOffs < LINKED_WINDOW
+    ? state->histOffs : LINKED_WINDOW;
+  done =
+    LZ4_decompress_safe_usingDict(input, output, length, maxout,
+                                  (const char*)
+                                  &state->histBuff[state->histOffs - dict_size],
+                                  dict_size);
+  if (done > 0) {
+    fastlzlibHistoryAppend(s, output, done);
+  }
+  return done;
+}
+
+#endif
+
+/* write the stream information block to "dest", if the stream needs one ;
+   returns the written size (at most INFO_MAX_SIZE) */
+static uInt fastlz_write_info(const zfast_stream *const s, Bytef* dest,
+                              uInt block_size) {
+  Bytef *const data = &dest[HEADER_SIZE];
+  uInt size = 0;
+#ifdef ZFAST_USE_LZ4
+  if (s->state->backend.dict != NULL
+      && s->state->compressor == COMPRESSOR_LZ4) {
+    data[size++] = INFO_DICTIONARY_ID;
+    data[size++] = 4;
+    WRITE_32(&data[size], s->state->backend.dict->id);
+    size += 4;
+  }
+#endif
+  if (s->state->checksums != 0) {
+    data[size++] = INFO_FLAGS;
+    data[size++] = 1;
+    data[size++] = (Bytef) s->state->checksums;
+  }
+  if (size == 0) {
+    return 0;
+  }
+  assert(HEADER_SIZE + size <= INFO_MAX_SIZE);
+  return fastlz_write_header(dest, BLOCK_TYPE_INFO, block_size, size, 0)
+    + size;
+}
+
+#ifdef ZFAST_USE_LZ4
+
+/* write a padding block of exactly "size" bytes (see ZFAST_IS_PADDING_SIZE):
+   an information block made of padding records */
+static uInt fastlz_write_padding(Bytef* dest, uInt size, uInt block_size) {
+  uInt i;
+  assert(ZFAST_IS_PADDING_SIZE(size));
+  if (size == 0) {
+    return 0;
+  }
+  fastlz_write_header(dest, BLOCK_TYPE_INFO, block_size, size - HEADER_SIZE,
+                      0);
+  for(i = HEADER_SIZE ; i < size ; ) {
+    uInt len = size - i - 2;
+    /* records are at most 257 bytes long, and never leave a single byte */
+    if (len > 255) {
+      len = len == 256 ? 254 : 255;
+    }
+    dest[i] = INFO_PADDING;
+    dest[i + 1] = (Bytef) len;
+    memset(&dest[i + 2], 0, len);
+    i += 2 + len;
+  }
+  return size;
+}
+
+#endif
+
+/* write the end of the stream: the content checksum, if any, and the EOF
+   marker (empty block with compressed=uncompressed=0) ; returns the written
+   size (ZFAST_EOF_SIZE) */
+static uInt fastlz_write_eof(const zfast_stream *const s, Bytef* dest,
+                             uInt block_size) {
+  uInt size = 0;
+  if (( s->state->checksums & ZFAST_CHECKSUM_CONTENT ) != 0) {
+    const XXH64_hash_t hash = XXH64_digest(&s->state->content);
+    const uInt low = (uInt) hash;
+    const uInt high = (uInt) ( hash >> 32 );
+    Bytef *const data = &dest[HEADER_SIZE];
+    data[0] = INFO_CONTENT_CHECKSUM;
+    data[1] = 8;
+    WRITE_32(&data[2], low);
+    WRITE_32(&data[6], high);
+    size = fastlz_write_header(dest, BLOCK_TYPE_INFO, block_size,
+                               CONTENT_CHECKSUM_SIZE - HEADER_SIZE, 0)
+      + CONTENT_CHECKSUM_SIZE - HEADER_SIZE;
+  }
+  size += fastlz_write_header(&dest[size], BLOCK_TYPE_COMPRESSED, block_size,
+                              0, 0);
+  s->state->eof_done = 1;
+  return size;
+}
+
+/* make room for one more seek index entry (OPTION_INDEX), growing the
+   index buffer */
+static int fastlzlibIndexReserve(zfast_stream *s) {
+  zfast_stream_internal *const state = s->state;
+  if (state->index_count == state->indexCapacity) {
+    const uInt capacity = state->indexCapacity != 0
+      ? state->indexCapacity * 2 : 256;
+    Bytef *buff;
+    /* the trailer size must fit in a block header */
+    if (capacity > ( 0xffffffff - INDEX_TRAILER_SIZE(0) ) / INDEX_ENTRY_SIZE) {
+      return Z_MEM_ERROR;
+    }
+    buff = buff_zalloc(s, INDEX_TRAILER_SIZE(capacity), ZFAST_ALLOC_BUFFER);
+    if (buff == NULL) {
+      return Z_MEM_ERROR;
+    }
+    if (state->indexBuff != NULL) {
+      memcpy(&buff[HEADER_SIZE], &state->indexBuff[HEADER_SIZE],
+             state->index_count * INDEX_ENTRY_SIZE);
+      buff_zfree(s, state->indexBuff, INDEX_TRAILER_SIZE(state->indexCapacity));
+    }
+    state->indexBuff = buff;
+    state->indexCapacity = capacity;
+  }
+  return Z_OK;
+}
+
+/* record in the seek index the independent block whose header is written at
+   the stream offset "offset", and holding the content from pos_in (room was
+   made by fastlzlibIndexReserve()) */
+static ZFASTINLINE void fastlzlibIndexAdd(const zfast_stream *const s,
+                                          uint64_t offset) {
+  Bytef *const entry = &s->state->indexBuff[HEADER_SIZE
+                                            + s->state->index_count
+                                            * INDEX_ENTRY_SIZE];
+  assert(s->state->index_count < s->state->indexCapacity);
+  WRITE_64(entry, offset);
+  WRITE_64(&entry[8], s->state->pos_in);
+  s->state->index_count++;
+}
+
+/* write the seek index trailer in the index buffer, following the EOF
+   marker: the index block, ended by the locator footer ; returns its size
+   (INDEX_TRAILER_SIZE) */
+static uInt fastlz_write_index(const zfast_stream *const s) {
+  Bytef *const dest = s->state->indexBuff;
+  const uInt count = s->state->index_count;
+  const uInt size = count * INDEX_ENTRY_SIZE;
+  Bytef *const footer = &dest[HEADER_SIZE + size];
+  uInt flags = s->state->checksums;
+  uInt dict_id = 0;
+#ifdef ZFAST_USE_LZ4
+  if (s->state->backend.dict != NULL
+      && s->state->compressor == COMPRESSOR_LZ4) {
+    flags |= INDEX_FLAG_DICTIONARY;
+    dict_id = s->state->backend.dict->id;
+  }
+#endif
+  fastlz_write_header(dest, BLOCK_TYPE_INDEX, BLOCK_SIZE(s),
+                      size + INDEX_FOOTER_SIZE, 0);
+  WRITE_64(&footer[0], s->state->pos_out);
+  WRITE_64(&footer[8], s->state->pos_in);
+  WRITE_32(&footer[16], count);
+  WRITE_32(&footer[20], dict_id);
+  WRITE_8(&footer[24], flags);
+  memset(&footer[25], 0, 3);
+  WRITE_32(&footer[28], (uInt) XXH32(&dest[HEADER_SIZE], size + 28, 0));
+  memcpy(&footer[32], INDEX_MAGIC, sizeof(INDEX_MAGIC));
+  return INDEX_TRAILER_SIZE(count);
+}
+
+/* read the stream information block */
+static int fastlzlibReadInfo(zfast_stream *s, const Bytef *in, uInt size) {
+  uInt i;
+  for(i = 0 ; i + 2 <= size ; ) {
+    const uInt tag = in[i];
+    const uInt len = in[i + 1];
+    const Bytef *const value = &in[i + 2];
+    if (i + 2 + len > size) {
+      break;
+    }
+    switch(tag) {
+    case INFO_PADDING:
+      break;
+    case INFO_DICTIONARY_ID:
+      if (len != 4) {
+        s->msg = "corrupted compressed stream (illegal stream information)";
+        return Z_DATA_ERROR;
+      }
+      s->state->dict_id = (uInt) READ_32(value);
+      s->state->dict_required = 1;
+      break;
+    case INFO_FLAGS:
+      if (len != 1) {
+        s->msg = "corrupted compressed stream (illegal stream information)";
+        return Z_DATA_ERROR;
+      }
+      if (( value[0] & ~( ZFAST_CHECKSUM_BLOCK | ZFAST_CHECKSUM_CONTENT ) )
+          != 0) {
+        s->msg = "unsupported stream features";
+        return Z_VERSION_ERROR;
+      }
+      s->state->flags = value[0];
+      XXH64_reset(&s->state->content, 0);
+      break;
+    case INFO_CONTENT_CHECKSUM:
+      if (len != 8) {
+        s->msg = "corrupted compressed stream (illegal stream information)";
+        return Z_DATA_ERROR;
+      }
+      if (( s->state->flags & ZFAST_CHECKSUM_CONTENT ) != 0
+          && s->state->verify) {
+        const XXH64_hash_t hash = XXH64_digest(&s->state->content);
+        if (READ_32(value) != (uInt) hash
+            || READ_32(&value[4]) != (uInt) ( hash >> 32 )) {
+          s->msg = "content checksum mismatch";
+          return Z_DATA_ERROR;
+        }
+      }
+      break;
+    default:
+      /* unknown records are ignored */
+      break;
+    }
+    i += 2 + len;
+  }
+  if (i != size) {
+    s->msg = "corrupted compressed stream (illegal stream information)";
+    return Z_DATA_ERROR;
+  }
+
+  /* check the preset dictionary */
+  if (s->state->dict_required) {
+    if (s->state->backend.dict == NULL) {
+      s->adler = s->state->dict_id;
+      s->msg = "need dictionary";
+      return Z_NEED_DICT;
+    } else if (s->state->backend.dict->id != s->state->dict_id) {
+      s->msg = "incorrect dictionary";
+      return Z_DATA_ERROR;
+    }
+  }
+
+  return Z_OK;
+}
+
+#ifdef ZFAST_USE_LZ4
+
+/* can linked blocks be emitted by this stream ? */
+static ZFASTINLINE int fastlzlibIsLinked(const zfast_stream *const s) {
+  return s->state->linked && s->state->compressor == COMPRESSOR_LZ4;
+}
+
+#endif
+
+/* magic numbers of already compressed formats */
+static const struct {
+  const char *magic;
+  uInt offset;
+  uInt size;
+} compressed_magics[] = {
+  { "\x1f\x8b", 0, 2 },                       /* gzip */
+  { "PK\x03\x04", 0, 4 },                     /* zip, jar, office */
+  { "BZh", 0, 3 },                            /* bzip2 */
+  { "\xfd" "7zXZ", 0, 5 },                    /* xz */
+  { "7z\xbc\xaf\x27\x1c", 0, 6 },             /* 7-zip */
+  { "\x28\xb5\x2f\xfd", 0, 4 },               /* zstd */
+  { "\x04\x22\x4d\x18", 0, 4 },               /* lz4 frame */
+  { "FastLZ", 0, 7 },                         /* fastlz stream */
+  { "\xff\xd8\xff", 0, 3 },                   /* jpeg */
+  { "\x89PNG", 0, 4 },                        /* png */
+  { "GIF8", 0, 4 },                           /* gif */
+  { "OggS", 0, 4 },                           /* ogg */
+  { "ftyp", 4, 4 },                           /* mp4, mov, heif */
+  { "WEBP", 8, 4 }                            /* webp */
+};
+
+/* the data begins with the signature of a compressed format */
+static int fastlzlibIsCompressedFormat(const Bytef *in, uInt length) {
+  size_t i;
+  for(i = 0 ; i < sizeof(compressed_magics)/sizeof(compressed_magics[0])
+        ; i++) {
+    if (compressed_magics[i].offset + compressed_magics[i].size <= length
+        && memcmp(&in[compressed_magics[i].offset], compressed_magics[i].magic,
+                  compressed_magics[i].size) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* the byte distribution of evenly spread sampled runs is close to the
+   uniform one (compressed or encrypted data) ; the sum of squared counts
+   (collision entropy) is compared to its expected uniform value */
+static int fastlzlibIsHighEntropy(const Bytef *in, uInt length) {
+  uInt count[256];
+  const uInt runs = length / DETECT_RUN_SIZE < DETECT_RUNS
+    ? length / DETECT_RUN_SIZE : DETECT_RUNS;
+  const uInt step = runs > 1 ? ( length - DETECT_RUN_SIZE ) / ( runs - 1 ) : 0;
+  const uInt n = runs*DETECT_RUN_SIZE;
+  uLong sum = 0;
+  uInt i, j;
+  memset(count, 0, sizeof(count));
+  for(i = 0 ; i < runs ; i++) {
+    const Bytef *const run = &in[i*step];
+    for(j = 0 ; j < DETECT_RUN_SIZE ; j++) {
+      count[run[j]]++;
+    }
+  }
+  for(i = 0 ; i < 256 ; i++) {
+    sum += count[i]*count[i];
+  }
+  /* within 25% of n + n(n-1)/256 (text is usually 10 times above) */
+  return sum*4 <= ( n + n*( n - 1 ) / 256 )*5;
+}
+
+/* trial compression of a slice in the middle of the block, using the fastest
+   mode of the stream backend context (or the fastest built-in compressor if
+   the stream has none), and "scratch" as output */
+static int fastlzlibIsTrialIncompressible(zfast_stream *s,
+                                          const Bytef *in, uInt length,
+                                          Bytef *scratch, uInt scratch_size) {
+  zfast_backend_ctx *const ctx = &s->state->backend;
+  const uInt size = length / 4 < DETECT_TRIAL_SIZE
+    ? length / 4 : DETECT_TRIAL_SIZE;
+  const Bytef *const slice = &in[( length - size ) / 2];
+  int done;
+  (void) ctx;
+#ifdef ZFAST_USE_LZ4
+  /* LZ4 states also hold the linked blocks chain, which is then restarted */
+  if (ctx->lz4 != NULL || ctx->lz4hc != NULL) {
+    done = ctx->lz4 != NULL
+      ? LZ4_compress_fast_extState_fastReset(ctx->lz4, (const char*) slice,
+                                             (char*) scratch, size,
+                                             scratch_size, 1)
+      : LZ4_compress_HC_extStateHC_fastReset(ctx->lz4hc, (const char*) slice,
+                                             (char*) scratch, size,
+                                             scratch_size, LZ4HC_CLEVEL_MIN);
+    s->state->linked_count = 0;
+  } else
+#endif
+#ifdef ZFAST_USE_FASTLZ
+  if (ctx->fastlz.htab != NULL) {
+    done = fastlz_backend_compress(ctx, Z_BEST_SPEED, slice, size, scratch,
+                                   scratch_size);
+  } else
+#endif
+  {
+#if defined(ZFAST_USE_FASTLZ)
+    done = fastlz_compress_level(1, slice, size, scratch);
+#elif defined(ZFAST_USE_LZ4)
+    done = LZ4_compress_default((const char*) slice, (char*) scratch, size,
+                                scratch_size);
+#else
+    (void) slice;
+    (void) scratch;
+    (void) scratch_size;
+    return 1;
+#endif
+  }
+  return done <= 0
+    || (uLong) done*100 >= (uLong) size*( 100 - DETECT_TRIAL_GAIN );
+}
+
+/* register the outcome of a block compression (backing off after repeated
+   failures ; a single failure after backing off backs off again) */
+static ZFASTINLINE void fastlzlibBlockOutcome(zfast_stream *s, int failed) {
+  if (!failed) {
+    s->state->failures = 0;
+  } else if (s->state->failures < BACKOFF_FAILURES) {
+    s->state->failures++;
+  }
+  if (s->state->failures >= BACKOFF_FAILURES) {
+    s->state->backoff = s->state->backoff_blocks;
+  }
+}
+
+/* the block looks incompressible, if detection is enabled ("scratch" is used
+   for the trial) */
+static int fastlzlibIsIncompressible(zfast_stream *s, const Bytef *in,
+                                     uInt length, Bytef *scratch,
+                                     uInt scratch_size) {
+  return s->state->detect && length >= DETECT_MIN_SIZE
+    && ( fastlzlibIsCompressedFormat(in, length)
+         || fastlzlibIsHighEntropy(in, length) )
+    && fastlzlibIsTrialIncompressible(s, in, length, scratch, scratch_size);
+}
+
+/* the block is not worth compressing: the stream is backing off, or the
+   block looks incompressible ("scratch" is used for the trial) */
+static int fastlzlibSkipBlock(zfast_stream *s, const Bytef *in, uInt length,
+                              Bytef *scratch, uInt scratch_size) {
+  if (s->state->backoff != 0) {
+    s->state->backoff--;
+    return 1;
+  }
+  if (fastlzlibIsIncompressible(s, in, length, scratch, scratch_size)) {
+    fastlzlibBlockOutcome(s, 1);
+    return 1;
+  }
+  return 0;
+}
+
+/* the compressed size achieves the minimum gain */
+static ZFASTINLINE int fastlzlibIsGain(const zfast_stream *const s,
+                                       uInt done, uInt length) {
+  return (uLong) done*100 < (uLong) length*( 100 - s->state->min_gain );
+}
+
+/* type of the blocks tagged with the compressor "compressor" */
+static ZFASTINLINE uInt fastlzlibTaggedBlockType(int compressor) {
+  switch(compressor) {
+  case COMPRESSOR_FASTLZ:
+    return BLOCK_TYPE_FASTLZ;
+  case COMPRESSOR_LZ4:
+    return BLOCK_TYPE_LZ4;
+  case COMPRESSOR_LZFSE:
+    return BLOCK_TYPE_LZFSE;
+  default:
+    return BLOCK_TYPE_COMPRESSED;
+  }
+}
+
+/* type of the blocks compressed by the stream backend */
+static ZFASTINLINE uInt fastlzlibCompressedBlockType(const zfast_stream *const
+                                                     s) {
+  return s->state->tagged
+    ? fastlzlibTaggedBlockType(s->state->compressor)
+    : BLOCK_TYPE_COMPRESSED;
+}
+
+/* compress a block with the built-in compressor "compressor" */
+static int fastlzlibBackendCompress(zfast_stream *s, int compressor,
+                                    int level, const void* input, int length,
+                                    void* output, int maxout) {
+  void *const ctx = &s->state->backend;
+  switch(compressor) {
+#ifdef ZFAST_USE_FASTLZ
+  case COMPRESSOR_FASTLZ:
+    return fastlz_backend_compress(ctx, level, input, length, output, maxout);
+#endif
+#ifdef ZFAST_USE_LZ4
+  case COMPRESSOR_LZ4:
+    return lz4_backend_compress(ctx, level, input, length, output, maxout);
+#endif
+#ifdef ZFAST_USE_LZFSE
+  case COMPRESSOR_LZFSE:
+    return lzfse_backend_compress(ctx, level, input, length, output, maxout);
+#endif
+  default:
+    break;
+  }
+  (void) ctx;
+  (void) level;
+  (void) input;
+  (void) length;
+  (void) output;
+  (void) maxout;
+  return 0;
+}
+
+/* monotonic clock, in microseconds (wrapping) */
+static uLong fastlzlibClock(void) {
+#ifdef _WIN32
+  LARGE_INTEGER now, freq;
+  QueryPerformanceCounter(&now);
+  QueryPerformanceFrequency(&freq);
+  return (uLong) ( now.QuadPart / freq.QuadPart * 1000000
+                   + now.QuadPart % freq.QuadPart * 1000000 / freq.QuadPart );
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uLong) ts.tv_sec * 1000000 + (uLong) ts.tv_nsec / 1000;
+#endif
+}
+
+/* compressed size per 1024 bytes, and speed in 1/16 of MB/s */
+#define AUTO_RATIO(DONE, LENGTH)                                        \
+  ( (DONE) > 0 && (uLong) (DONE) < (uLong) (LENGTH)                     \
+    ? (uLong) (DONE) * 1024 / (uLong) (LENGTH) + 1 : 1025 )
+#define AUTO_SPEED(LENGTH, ELAPSED)                                     \
+  ( (uLong) (LENGTH) * 16 / ( (ELAPSED) != 0 ? (ELAPSED) : 1 ) + 1 )
+
+/* trial compression of a slice of the block by each candidate (too slow
+   candidates being only measured from time to time), using "scratch" as
+   output, and selection of the best ratio among candidates meeting the
+   minimum speed, or of the fastest one */
+static void fastlzlibAutoTrial(zfast_stream *s, const Bytef *in, uInt length,
+                               Bytef *scratch, uInt scratch_size) {
+  const uLong min_speed = (uLong) s->state->min_speed * 16;
+  const uInt size = length / 16 < AUTO_TRIAL_MIN_SIZE
+    ? ( length < AUTO_TRIAL_MIN_SIZE ? length : AUTO_TRIAL_MIN_SIZE )
+    : ( length / 16 > AUTO_TRIAL_MAX_SIZE ? AUTO_TRIAL_MAX_SIZE
+        : length / 16 );
+  const Bytef *const slice = &in[( length - size ) / 2];
+  uInt best = s->state->nb_candidates;
+  uInt fastest = 0;
+  uInt i;
+  for(i = 0 ; i < s->state->nb_candidates ; i++) {
+    zfast_auto_candidate *const c = &s->state->candidates[i];
+    if (c->speed == 0 || c->speed >= min_speed
+        || ++c->skipped >= AUTO_SLOW_SKIPS) {
+      const uLong start = fastlzlibClock();
+      const int done = fastlzlibBackendCompress(s, c->compressor, c->level,
+                                                slice, size, scratch,
+                                                scratch_size);
+      const uLong speed = AUTO_SPEED(size, fastlzlibClock() - start);
+      c->ratio = AUTO_RATIO(done, size);
+      c->speed = c->speed != 0 ? ( c->speed + speed ) / 2 : speed;
+      c->skipped = 0;
+    }
+    if (c->speed >= min_speed
+        && ( best == s->state->nb_candidates
+             || c->ratio < s->state->candidates[best].ratio )) {
+      best = i;
+    }
+    if (c->speed > s->state->candidates[fastest].speed) {
+      fastest = i;
+    }
+  }
+  s->state->auto_current = best != s->state->nb_candidates ? best : fastest;
+  s->state->auto_ratio = 0;
+}
+
+/* compress a block with the adaptive compressor: the candidate is selected
+   by a trial every AUTO_TRIAL_INTERVAL blocks, or when the ratio of the
+   previous block changed ; the block type is returned in "type" */
+static int fastlzlibAutoCompress(zfast_stream *s, const void* input,
+                                 int length, void* output, int maxout,
+                                 uInt *type) {
+  zfast_auto_candidate *c;
+  uLong start, ratio;
+  int done;
+
+  if (s->state->auto_blocks == 0) {
+    fastlzlibAutoTrial(s, (const Bytef*) input, (uInt) length,
+                       (Bytef*) output, (uInt) maxout);
+    s->state->auto_blocks = AUTO_TRIAL_INTERVAL;
   }
-  return block_size;
+  s->state->auto_blocks--;
+  c = &s->state->candidates[s->state->auto_current];
+
+  start = fastlzlibClock();
+  done = fastlzlibBackendCompress(s, c->compressor, c->level, input, length,
+                                  output, maxout);
+  c->speed = ( c->speed*3 + AUTO_SPEED(length, fastlzlibClock() - start) )
+    / 4;
+
+  /* the data changed: new trial */
+  ratio = AUTO_RATIO(done, length);
+  if (s->state->auto_ratio != 0
+      && ( ratio*4 < s->state->auto_ratio*3
+           || ratio*4 > s->state->auto_ratio*5 ) ) {
+    s->state->auto_blocks = 0;
+  }
+  s->state->auto_ratio = ratio;
+
+  *type = fastlzlibTaggedBlockType(c->compressor);
+  return done;
 }
 
-int fastlzlibGetStreamInfo(const void* input, int length,
-                           uInt *compressed_size,
-                           uInt *uncompressed_size) {
-  if (input != NULL && compressed_size != NULL && uncompressed_size != NULL) {
-    if (length >= HEADER_SIZE) {
-      uInt block_size = 0;
-      uInt block_type;
-      fastlz_read_header((const Bytef*) input, &block_type, &block_size,
-                         compressed_size, uncompressed_size);
-      if (block_size != 0) {
-        return Z_OK;
-      } else {
-        return Z_DATA_ERROR;
-      }
-    } else {
-      return Z_BUF_ERROR;
+/* decompress a block tagged with its compressor, whatever the stream
+   compressor is */
+static int fastlzlibDecompressTagged(zfast_stream *s, uInt type,
+                                     const void* input, int length,
+                                     void* output, int maxout) {
+  void *const ctx = &s->state->backend;
+  switch(type) {
+#ifdef ZFAST_USE_FASTLZ
+  case BLOCK_TYPE_FASTLZ:
+    return fastlz_backend_decompress(ctx, input, length, output, maxout);
+#endif
+#ifdef ZFAST_USE_LZ4
+  case BLOCK_TYPE_LZ4:
+    return lz4_backend_decompress(ctx, input, length, output, maxout);
+#endif
+#ifdef ZFAST_USE_LZFSE
+  case BLOCK_TYPE_LZFSE:
+    if (fastlzlibBackendScratch(s, (uInt) lzfse_decode_scratch_size())
+        != Z_OK) {
+      return -1;
     }
-  } else {
-    return Z_STREAM_ERROR;
+    return lzfse_backend_decompress(ctx, input, length, output, maxout);
+#endif
+  default:
+    break;
   }
+  (void) ctx;
+  (void) input;
+  (void) length;
+  (void) output;
+  (void) maxout;
+  return -1;
+}
+
+/* upper bound of the size written by fastlz_compress_hdr() for "length"
+   bytes */
+static ZFASTINLINE uInt fastlz_compress_hdr_bound(const zfast_stream *const s,
+                                                  uInt length, int flush) {
+  return ( s->state->info_done ? 0 : INFO_MAX_SIZE )
+    + fastlzlibBlockBound(s, length)
+    + ( flush == Z_FINISH ? ZFAST_EOF_SIZE(s->state->checksums) : 0 );
 }
 
 /* helper for fastlz_compress */
-static ZFASTINLINE int fastlz_compress_hdr(const zfast_stream *const s,
+static ZFASTINLINE int fastlz_compress_hdr(zfast_stream *const s,
                                            const void* input, uInt length,
                                            void* output, uInt output_length,
                                            int block_size, int level,
                                            int flush) {
   uInt done = 0;
-  Bytef*const output_start = (Bytef*) output;
+  uInt done_info = 0;
+  Bytef* output_start = (Bytef*) output;
+  /* stream information precedes the first block */
+  if (length > 0 && !s->state->info_done) {
+    const uInt info_size = fastlz_write_info(s, output_start, block_size);
+    s->state->info_done = 1;
+    output_start += info_size;
+    output_length -= info_size;
+    done_info = info_size;
+  }
   if (length > 0) {
     void*const output_data_start = &output_start[HEADER_SIZE];
-    const uInt output_data_max = output_length - HEADER_SIZE;
+    const uInt checksum_size = ZFAST_BLOCK_CHECKSUM_SIZE(s->state->checksums);
+    /* room left for the block checksum and the end of stream */
+    const uInt output_data_max = output_length - HEADER_SIZE - checksum_size
+      - ( flush == Z_FINISH ? ZFAST_EOF_SIZE(s->state->checksums) : 0 );
     uInt type;
     /* compress and fill header after */
-    if (length > MIN_BLOCK_SIZE) {
-      done = ZFAST_COMPRESS(level, input, length, output_data_start, output_data_max);
-      assert(done + HEADER_SIZE*2 <= output_length);
-      if (done < length) {
-        type = BLOCK_TYPE_COMPRESSED;
+    if (length > MIN_BLOCK_SIZE
+        && !fastlzlibSkipBlock(s, (const Bytef*) input, length,
+                               (Bytef*) output_data_start, output_data_max)) {
+#ifdef ZFAST_USE_LZ4
+      if (fastlzlibIsLinked(s)) {
+        const int keyframe = s->state->linked_count == 0;
+        done = lz4_linked_compress(s, keyframe, level, input, length,
+                                   output_data_start, output_data_max);
+        type = keyframe ? BLOCK_TYPE_KEYFRAME : BLOCK_TYPE_LINKED;
+        /* next block is a keyframe if the chain is broken, or periodically */
+        if (done == 0 || done >= length || flush == Z_FULL_FLUSH
+            || ( s->state->keyframe_interval != 0
+                 && s->state->linked_count + 1
+                 >= s->state->keyframe_interval ) ) {
+          s->state->linked_count = 0;
+        } else {
+          s->state->linked_count++;
+        }
+      } else
+#endif
+      {
+        if (s->state->compressor == COMPRESSOR_AUTO) {
+          done = fastlzlibAutoCompress(s, input, length,
+                                       output_data_start, output_data_max,
+                                       &type);
+        } else {
+          done = ZFAST_COMPRESS(level, input, length, output_data_start, output_data_max);
+          type = fastlzlibCompressedBlockType(s);
+        }
       }
-      /* compressed version is greater ; use raw data */
-      else {
+      assert(done <= output_data_max);
+      /* compressed version is greater (or failed) ; use raw data */
+      if (done == 0 || !fastlzlibIsGain(s, done, length)) {
         memcpy(output_data_start, input, length);
         done = length;
         type = BLOCK_TYPE_RAW;
+        s->state->linked_count = 0;
       }
+      fastlzlibBlockOutcome(s, type == BLOCK_TYPE_RAW);
     }
-    /* store small chunk as raw data */
+    /* store small chunk, or incompressible data, as raw data (breaking any
+       linked blocks chain) */
     else {
-      assert(length + HEADER_SIZE*2 <= output_length);
+      assert(length <= output_data_max);
       memcpy(output_data_start, input, length);
       done = length;
       type = BLOCK_TYPE_RAW;
+      s->state->linked_count = 0;
     }
+    /* checksums of the stored data, and of the content */
+    if (checksum_size != 0) {
+      const uInt checksum = (uInt) XXH32(output_data_start, done, 0);
+      WRITE_32(&((Bytef*) output_data_start)[done], checksum);
+      done += checksum_size;
+    }
+    if (( s->state->checksums & ZFAST_CHECKSUM_CONTENT ) != 0) {
+      XXH64_update(&s->state->content, input, length);
+    }
+    /* seek index entry */
+    if (s->state->index && type != BLOCK_TYPE_LINKED) {
+      fastlzlibIndexAdd(s, s->state->pos_out + done_info);
+    }
+    s->state->pos_in += length;
     /* write back header */
     done += fastlz_write_header(output_start, type, block_size, done, length);
   }
-  /* write an EOF marker (empty block with compressed=uncompressed=0) */
+  /* end of stream */
   if (flush == Z_FINISH) {
-    Bytef*const output_end = &output_start[done];
-    done += fastlz_write_header(output_end, BLOCK_TYPE_COMPRESSED, block_size,
-                                0, 0);
+    done += fastlz_write_eof(s, &output_start[done], block_size);
   }
   assert(done <= output_length);
-  return done;
+  s->state->pos_out += done + done_info;
+  return done + done_info;
+}
+
+#ifdef ZFAST_USE_LZ4
+
+/* compress as much of "input" as fits in one block of at most "size" bytes,
+   followed by "checksum_size" bytes of checksum, leaving a gap that can be
+   filled with a padding block, or store it as raw data if "skip" is set ;
+   "*length" is updated with the consumed size, and "*type" with the block
+   type. returns the block size (zero if there is no input) */
+static uInt fastlz_compress_page_block(zfast_stream *s,
+                                       const Bytef *input, uInt *length,
+                                       Bytef *output, uInt size,
+                                       uInt block_size, int level,
+                                       uInt checksum_size, int skip,
+                                       uInt *type) {
+  Bytef *const output_data_start = &output[HEADER_SIZE];
+  const uInt output_data_max = size - HEADER_SIZE - checksum_size;
+  uInt room = output_data_max;
+  uInt done;
+  uInt consumed;
+  if (*length == 0) {
+    return 0;
+  }
+  for(;;) {
+    /* input stored as raw data */
+    const uInt raw = *length < room ? *length : room;
+    int n = (int) *length;
+    done = skip || *length <= MIN_BLOCK_SIZE ? 0
+      : (uInt) lz4_backend_compress_dest(&s->state->backend, level, input, &n,
+                                         output_data_start, (int) room);
+    consumed = (uInt) n;
+    /* compressed version does not hold more data (or failed) ; use raw
+       data */
+    if (done == 0 || consumed <= raw) {
+      memcpy(output_data_start, input, raw);
+      done = consumed = raw;
+      *type = BLOCK_TYPE_RAW;
+    } else {
+      *type = fastlzlibCompressedBlockType(s);
+    }
+    /* the remaining gap can not be padded: leave room for the smallest
+       padding block (the gap is then large enough) */
+    if (ZFAST_IS_PADDING_SIZE(output_data_max - done)) {
+      break;
+    }
+    assert(room == output_data_max);
+    room = output_data_max - PADDING_MIN_SIZE;
+  }
+  if (checksum_size != 0) {
+    const uInt checksum = (uInt) XXH32(output_data_start, done, 0);
+    WRITE_32(&output_data_start[done], checksum);
+    done += checksum_size;
+  }
+  *length = consumed;
+  return fastlz_write_header(output, *type, block_size, done, consumed) + done;
+}
+
+/* compress as much of "input" as fits in a page of exactly "page_size" bytes
+   (see OPTION_PAGE_SIZE), "*length" being updated with the consumed size:
+   stream information and a block, followed by padding and, if the input is
+   entirely consumed when finishing ("finish"), the EOF marker. returns the
+   page size, or zero if there was nothing to write */
+static uInt fastlz_compress_page(zfast_stream *s,
+                                 const Bytef *input, uInt *length,
+                                 Bytef *output, uInt page_size,
+                                 uInt block_size, int level, int finish) {
+  const uInt input_length = *length;
+  const uInt checksum_size = ZFAST_BLOCK_CHECKSUM_SIZE(s->state->checksums);
+  const uInt eof_size = ZFAST_EOF_SIZE(s->state->checksums);
+  uInt info_size = 0;
+  uInt size;
+  uInt done;
+  uInt type = BLOCK_TYPE_RAW;
+  int skip = 0;
+  if (input_length == 0 && !finish) {
+    return 0;
+  }
+  /* stream information precedes the first block */
+  if (input_length > 0 && !s->state->info_done) {
+    info_size = fastlz_write_info(s, output, block_size);
+    s->state->info_done = 1;
+    output += info_size;
+  }
+  size = page_size - info_size;
+  /* back-off and detection are applied once per page, the block area being
+     used as scratch for the trial compression */
+  if (input_length > MIN_BLOCK_SIZE) {
+    const uInt output_data_max = size - HEADER_SIZE - checksum_size;
+    skip = fastlzlibSkipBlock(s, input, input_length < output_data_max
+                              ? input_length : output_data_max,
+                              &output[HEADER_SIZE], output_data_max);
+  }
+  done = fastlz_compress_page_block(s, input, length, output, size,
+                                    block_size, level, checksum_size, skip,
+                                    &type);
+  /* end the stream within this page if there is room for the end of stream,
+     recompressing the block to make room if needed (a padding block is kept
+     before the end, so that the page can still be padded if the input does
+     not fit anymore) */
+  if (finish && *length == input_length
+      && ( size - done < eof_size
+           || !ZFAST_IS_PADDING_SIZE(size - done - eof_size) )) {
+    done = fastlz_compress_page_block(s, input, length, output,
+                                      size - eof_size - PADDING_MIN_SIZE,
+                                      block_size, level, checksum_size, skip,
+                                      &type);
+  }
+  if (input_length > MIN_BLOCK_SIZE && !skip) {
+    fastlzlibBlockOutcome(s, type == BLOCK_TYPE_RAW);
+  }
+  if (( s->state->checksums & ZFAST_CHECKSUM_CONTENT ) != 0) {
+    XXH64_update(&s->state->content, input, *length);
+  }
+  /* seek index entry (page blocks are independent) */
+  if (s->state->index && *length != 0) {
+    fastlzlibIndexAdd(s, s->state->pos_out + info_size);
+  }
+  s->state->pos_in += *length;
+  s->state->pos_out += page_size;
+  if (finish && *length == input_length) {
+    size -= eof_size;
+    fastlz_write_eof(s, &output[size], block_size);
+  }
+  fastlz_write_padding(&output[done], size - done, block_size);
+  return page_size;
 }
 
+#endif
+
 /*
  * Compression and decompression processing routine.
  * The only difference with compression is that the input and output are
  * variables (may change with flush)
  */
+/* the current block can be decompressed in place: read at the end of the
+   output buffer, and decompressed at its beginning */
+static int fastlzlibIsInPlace(const zfast_stream *const s) {
+  const zfast_stream_internal *const state = s->state;
+  switch(state->block_type) {
+  case BLOCK_TYPE_RAW:
+  case BLOCK_TYPE_INFO:
+    return 1;
+#ifdef ZFAST_USE_LZ4
+  case BLOCK_TYPE_COMPRESSED:
+    if (state->compressor != COMPRESSOR_LZ4) {
+      return 0;
+    }
+    /* fall through */
+  case BLOCK_TYPE_LZ4:
+  case BLOCK_TYPE_KEYFRAME:
+  case BLOCK_TYPE_LINKED:
+    /* the decompressed data must never catch up with the compressed data */
+    return state->dec_size + LZ4_DECOMPRESS_INPLACE_MARGIN(state->str_size)
+      <= state->outBuffSize;
+#endif
+  default:
+    return 0;
+  }
+}
+
+/* account the decompressed data in the content checksum, if verified */
+static ZFASTINLINE void fastlzlibContentUpdate(zfast_stream *const s,
+                                               const Bytef *data, uInt size) {
+  if (( s->state->flags & ZFAST_CHECKSUM_CONTENT ) != 0 && s->state->verify
+      && size != 0) {
+    XXH64_update(&s->state->content, data, size);
+  }
+}
+
+/* the end of the stream was written: expose the seek index trailer, if any,
+   as pending output */
+static ZFASTINLINE void fastlzlibIndexTrailer(zfast_stream *const s) {
+  if (s->state->index && s->state->eof_done && !s->state->index_done) {
+    s->state->dec_size = fastlz_write_index(s);
+    s->state->outView = s->state->indexBuff;
+    s->state->outBuffOffs = 0;
+    s->state->index_done = 1;
+  }
+}
+
+/* drop the decompressed data preceding the position sought (see
+   fastlzlibSeek()) from the pending output */
+static ZFASTINLINE void fastlzlibDiscard(zfast_stream *const s) {
+  if (s->state->discard != 0) {
+    const uInt size = s->state->discard < s->state->dec_size
+      ? (uInt) s->state->discard : s->state->dec_size;
+    s->state->outBuffOffs = size;
+    s->state->discard -= size;
+  }
+}
+
+/* select where to buffer the current block, allocating the input buffer if
+   needed */
+static int fastlzlibInBlock(zfast_stream *const s) {
+  zfast_stream_internal *const state = s->state;
+  if (ZFAST_IS_DECOMPRESSING(s) && fastlzlibOutBuff(s) != Z_OK) {
+    return Z_MEM_ERROR;
+  }
+  if (ZFAST_IS_DECOMPRESSING(s) && fastlzlibIsInPlace(s)) {
+    state->inBlock = &state->outBuff[state->outBuffSize - state->str_size];
+    return Z_OK;
+  }
+  if (state->inBuff == NULL) {
+    state->inBuff = buff_zalloc(s, INPUT_BUFFER_SIZE(s), ZFAST_ALLOC_BUFFER);
+    if (state->inBuff == NULL) {
+      return Z_MEM_ERROR;
+    }
+  }
+  state->inBlock = state->inBuff;
+  return Z_OK;
+}
+
 static ZFASTINLINE int fastlzlibProcess(zfast_stream *const s, const int flush,
                                         const int may_buffer) {
   const Bytef *in = NULL;
@@ -646,22 +3776,41 @@ static ZFASTINLINE int fastlzlibProcess(zfast_stream *const s, const int flush,
     }
     /* copy and seek */
     if (size > 0) {
-      memcpy(s->next_out, &s->state->outBuff[s->state->outBuffOffs], size);
+      memcpy(s->next_out, &ZFAST_BUFFERED_OUTPUT(s)[s->state->outBuffOffs],
+             size);
       s->state->outBuffOffs += size;
       outSeek(s, size);
     }
+    /* the last chunk ends the stream, unless the seek index follows */
+    if (s->state->eof_done && !ZFAST_HAS_BUFFERED_OUTPUT(s)) {
+      fastlzlibIndexTrailer(s);
+      if (!ZFAST_HAS_BUFFERED_OUTPUT(s)) {
+        return Z_STREAM_END;
+      }
+    }
     /* and return chunk */
     return PROGRESS_OK();
   }
 
   /* read next block (note: output buffer is empty here) */
   else if (s->state->str_size == 0) {
-    /* for error reporting only */
+    /* stream block size (decompressing) */
     uInt block_size = 0;
 
     /* decompressing: header is present */
     if (ZFAST_IS_DECOMPRESSING(s)) {
 
+      /* skip the seek index (see below) */
+      if (s->state->skip != 0) {
+        uInt size = s->state->skip;
+        if (size > s->avail_in) {
+          size = s->avail_in;
+        }
+        inSeek(s, size);
+        s->state->skip -= size;
+        return PROGRESS_OK();
+      }
+
       /* sync to a block */
       if (flush == Z_SYNC_FLUSH && s->state->inHdrOffs == 0) {
         return Z_NEED_DICT;
@@ -691,8 +3840,9 @@ static ZFASTINLINE int fastlzlibProcess(zfast_stream *const s, const int flush,
         fastlz_read_header(s->next_in, &block_type, &block_size,
                            &str_size, &dec_size);
 
-        /* not buffered: check if we can do the job at once */
-        if (!may_buffer) {
+        /* not buffered: check if we can do the job at once (a seek index
+           is skipped without buffering) */
+        if (!may_buffer && block_type != BLOCK_TYPE_INDEX) {
           /* input buffer too small */
           if (s->avail_in < str_size) {
             s->msg = "need more data on input";
@@ -731,8 +3881,20 @@ static ZFASTINLINE int fastlzlibProcess(zfast_stream *const s, const int flush,
         return PROGRESS_OK();
       }
 
-      /* compressed and uncompressed == 0 : EOF marker */
-      if (s->state->str_size == 0 && s->state->dec_size == 0) {
+      /* seek index (OPTION_INDEX), following the EOF marker: skipped, its
+         size being unbounded */
+      if (s->state->block_type == BLOCK_TYPE_INDEX
+          && s->state->dec_size == 0) {
+        s->state->skip = s->state->str_size;
+        s->state->str_size = 0;
+        return PROGRESS_OK();
+      }
+
+      /* compressed and uncompressed == 0 : EOF marker (unless garbage) ;
+         a following stream declares its own checksums */
+      if (s->state->str_size == 0 && s->state->dec_size == 0
+          && s->state->block_type != BLOCK_TYPE_BAD_MAGIC) {
+        s->state->flags = 0;
         return Z_STREAM_END;
       }
     }
@@ -740,11 +3902,13 @@ static ZFASTINLINE int fastlzlibProcess(zfast_stream *const s, const int flush,
     else {
       uInt block_type = BLOCK_TYPE_COMPRESSED;
       uInt str_size = BLOCK_SIZE(s);
+      /* available input, including data left by the previous page */
+      const uInt avail_in = s->avail_in + s->state->inBuffOffs;
 
       /* not enough room on input */
-      if (str_size > s->avail_in) {
+      if (str_size > avail_in) {
         if (flush > Z_NO_FLUSH) {
-          str_size = s->avail_in;
+          str_size = avail_in;
         } else if (!may_buffer) {
           s->msg = "need more data on input";
           return Z_BUF_ERROR;
@@ -755,6 +3919,7 @@ static ZFASTINLINE int fastlzlibProcess(zfast_stream *const s, const int flush,
       s->state->block_type = block_type;
       s->state->str_size = str_size;
       s->state->dec_size = 0;  /* yet unknown */
+      s->state->outView = NULL;
     }
     
     /* output not buffered yet */
@@ -766,31 +3931,62 @@ static ZFASTINLINE int fastlzlibProcess(zfast_stream *const s, const int flush,
       return Z_DATA_ERROR;
     }
     else if (s->state->block_type != BLOCK_TYPE_RAW
-             && s->state->block_type != BLOCK_TYPE_COMPRESSED) {
+             && s->state->block_type != BLOCK_TYPE_COMPRESSED
+             && s->state->block_type != BLOCK_TYPE_INFO
+#ifdef ZFAST_USE_FASTLZ
+             && s->state->block_type != BLOCK_TYPE_FASTLZ
+#endif
+#ifdef ZFAST_USE_LZ4
+             && s->state->block_type != BLOCK_TYPE_LZ4
+             && s->state->block_type != BLOCK_TYPE_LINKED
+             && s->state->block_type != BLOCK_TYPE_KEYFRAME
+#endif
+#ifdef ZFAST_USE_LZFSE
+             && s->state->block_type != BLOCK_TYPE_LZFSE
+#endif
+             ) {
       s->msg = "corrupted compressed stream (illegal block type)";
       return Z_VERSION_ERROR;
     }
-    else if (block_size > BLOCK_SIZE(s)) {
-      s->msg = "block size too large";
-      return Z_VERSION_ERROR;
+    /* decompressing: follow the stream block size, growing the buffers
+       (empty at this point) on next use, or sizing them before their first
+       use */
+    if (block_size > BLOCK_SIZE(s)
+        || ( block_size != 0 && s->state->inBuff == NULL
+             && s->state->outBuff == NULL ) ) {
+      if (s->state->inBuff != NULL) {
+        buff_zfree(s, s->state->inBuff, INPUT_BUFFER_SIZE(s));
+        s->state->inBuff = NULL;
+      }
+      s->state->block_size = block_size;
     }
-    else if (s->state->dec_size > BUFFER_BLOCK_SIZE(s)) {
+    if (s->state->dec_size > BLOCK_SIZE(s)) {
       s->msg = "corrupted compressed stream (illegal decompressed size)";
       return Z_VERSION_ERROR;
     }
-    else if (s->state->str_size > BUFFER_BLOCK_SIZE(s)) {
+    else if (s->state->str_size > BLOCK_SIZE(s)
+             + ZFAST_BLOCK_CHECKSUM_SIZE(s->state->flags)) {
       s->msg = "corrupted compressed stream (illegal stream size)";
       return Z_VERSION_ERROR;
     }
     
     /* direct data fully available (ie. complete compressed block) ? */
-    if (s->avail_in >= s->state->str_size) {
+    if (s->avail_in >= s->state->str_size && !ZFAST_HAS_BUFFERED_INPUT(s)) {
       in = s->next_in;
-      inSeek(s, s->state->str_size);
+      /* pages seek the consumed input only */
+      if (!ZFAST_IS_PAGED(s)) {
+        inSeek(s, s->state->str_size);
+      }
     }
-    /* otherwise, buffered */
+    /* otherwise, buffered (after the data left by the previous page) */
     else {
-      s->state->inBuffOffs = 0;
+      if (!ZFAST_HAS_BUFFERED_INPUT(s)) {
+        s->state->inBuffOffs = 0;
+      }
+      if (fastlzlibInBlock(s) != Z_OK) {
+        s->msg = "memory exhausted";
+        return Z_MEM_ERROR;
+      }
     }
   }
 
@@ -808,20 +4004,20 @@ static ZFASTINLINE int fastlzlibProcess(zfast_stream *const s, const int flush,
         size = s->avail_in;
       }
       if (size > 0) {
-        memcpy(&s->state->inBuff[s->state->inBuffOffs], s->next_in, size);
+        memcpy(&s->state->inBlock[s->state->inBuffOffs], s->next_in, size);
         s->state->inBuffOffs += size;
         inSeek(s, size);
       }
     }
     /* block stream size (ie. compressed one) reached */
     if (s->state->inBuffOffs == s->state->str_size) {
-      in = s->state->inBuff;
+      in = s->state->inBlock;
       /* we are about to eat buffered data */
       s->state->inBuffOffs = 0;
     }
     /* forced flush: adjust str_size */
     else if (ZFAST_IS_COMPRESSING(s) && flush != Z_NO_FLUSH) {
-      in = s->state->inBuff;
+      in = s->state->inBlock;
       s->state->str_size = s->state->inBuffOffs;
       /* we are about to eat buffered data, reset it (now empty) */
       s->state->inBuffOffs = 0;
@@ -831,9 +4027,18 @@ static ZFASTINLINE int fastlzlibProcess(zfast_stream *const s, const int flush,
   /* we have a complete compressed block (str_size) : where to uncompress ? */
   if (in != NULL) {
     Bytef *out = NULL;
-    const uInt in_size = s->state->str_size;
+    uInt in_size = s->state->str_size;
 
     int flush_now = flush;
+
+    /* backend context allocated on first use, and room for the seek index
+       entry of the block */
+    if (fastlzlibBackendPrepare(s) != Z_OK
+        || ( ZFAST_IS_COMPRESSING(s) && s->state->index
+             && fastlzlibIndexReserve(s) != Z_OK ) ) {
+      s->msg = "memory exhausted";
+      return Z_MEM_ERROR;
+    }
     /* we are supposed to finish, but we did not eat all data: ignore for now */
     if (flush_now == Z_FINISH && !ZFAST_INPUT_IS_EMPTY(s)) {
       flush_now = Z_NO_FLUSH;
@@ -844,16 +4049,57 @@ static ZFASTINLINE int fastlzlibProcess(zfast_stream *const s, const int flush,
       int done = 0;
       const uInt out_size = s->state->dec_size;
 
-      /* can decompress directly on client memory */
-      if (s->avail_out >= s->state->dec_size) {
+      s->state->outView = NULL;
+
+      /* stored data checksum, verified before decompressing (the block is
+         dropped upon error) */
+      if (ZFAST_BLOCK_CHECKSUM_SIZE(s->state->flags) != 0
+          && s->state->block_type != BLOCK_TYPE_INFO) {
+        if (in_size < BLOCK_CHECKSUM_SIZE) {
+          s->state->str_size = 0;
+          s->msg = "corrupted compressed stream (illegal stream size)";
+          return Z_DATA_ERROR;
+        }
+        in_size -= BLOCK_CHECKSUM_SIZE;
+        if (s->state->verify
+            && (uInt) XXH32(in, in_size, 0) != READ_32(&in[in_size])) {
+          s->state->str_size = 0;
+          s->msg = "block checksum mismatch";
+          return Z_DATA_ERROR;
+        }
+      }
+
+      /* peeking at a stored block: expose it where it lies (client input, or
+         inBlock, which are left untouched until the block is consumed) */
+      if (s->state->peek && s->state->block_type == BLOCK_TYPE_RAW
+          && in_size == out_size) {
+        s->state->outView = in;
+        s->state->outBuffOffs = 0;
+        s->state->str_size = 0;
+        s->state->histOffs = 0;
+        fastlzlibContentUpdate(s, in, in_size);
+        fastlzlibDiscard(s);
+        return PROGRESS_OK();
+      }
+
+      /* can decompress directly on client memory (unless data precedes the
+         position sought) */
+      if (s->avail_out >= s->state->dec_size && s->state->discard == 0) {
         out = s->next_out;
+        s->state->backend.out_slack = s->avail_out - s->state->dec_size;
         outSeek(s, s->state->dec_size);
         /* no buffer */
         s->state->outBuffOffs = s->state->dec_size;
       }
       /* otherwise in output buffer */
       else {
+        if (fastlzlibOutBuff(s) != Z_OK) {
+          s->msg = "memory exhausted";
+          return Z_MEM_ERROR;
+        }
         out = s->state->outBuff;
+        s->state->backend.out_slack = s->state->outBuffSize
+          - s->state->dec_size;
         s->state->outBuffOffs = 0;
       }
 
@@ -864,10 +4110,45 @@ static ZFASTINLINE int fastlzlibProcess(zfast_stream *const s, const int flush,
       switch(s->state->block_type) {
       case BLOCK_TYPE_COMPRESSED:
         done = ZFAST_DECOMPRESS(in, in_size, out, out_size);
+        s->state->histOffs = 0;
+        break;
+      case BLOCK_TYPE_FASTLZ:
+      case BLOCK_TYPE_LZ4:
+      case BLOCK_TYPE_LZFSE:
+        done = fastlzlibDecompressTagged(s, s->state->block_type,
+                                         in, in_size, out, out_size);
+        s->state->histOffs = 0;
+        break;
+#ifdef ZFAST_USE_LZ4
+      case BLOCK_TYPE_KEYFRAME:
+        if (fastlzlibHistoryAlloc(s, LINKED_WINDOW*2) != Z_OK) {
+          s->msg = "memory exhausted";
+          return Z_MEM_ERROR;
+        }
+        done = lz4_keyframe_decompress(s, in, in_size, out, out_size);
+        break;
+      case BLOCK_TYPE_LINKED:
+        if (s->state->histOffs == 0) {
+          s->msg = "linked block without history";
+          return Z_DATA_ERROR;
+        }
+        done = lz4_linked_decompress(s, in, in_size, out, out_size);
+        break;
+#endif
+      case BLOCK_TYPE_INFO:
+        {
+          const int code = fastlzlibReadInfo(s, in, in_size);
+          if (code != Z_OK) {
+            return code;
+          }
+          done = 0;
+        }
         break;
       case BLOCK_TYPE_RAW:
+        s->state->histOffs = 0;
         if (out_size >= in_size) {
-          memcpy(out, in, in_size);
+          /* may overlap when decompressing in place */
+          memmove(out, in, in_size);
           done = in_size;
         } else {
           done = 0;
@@ -877,21 +4158,73 @@ static ZFASTINLINE int fastlzlibProcess(zfast_stream *const s, const int flush,
         assert(0);
         break;
       }
+      s->state->backend.out_slack = 0;
       if (done != (int) s->state->dec_size) {
         s->msg = "unable to decompress block stream";
         return Z_STREAM_ERROR;
       }
+      fastlzlibContentUpdate(s, out, out_size);
+      fastlzlibDiscard(s);
+    }
+#ifdef ZFAST_USE_LZ4
+    /* compressing a page */
+    else if (ZFAST_IS_PAGED(s)) {
+      const int direct = in == s->next_in;
+      const int finish = flush == Z_FINISH
+        && s->avail_in == ( direct ? in_size : 0 );
+      uInt length = in_size;
+      uInt done;
+      if (s->state->compressor != COMPRESSOR_LZ4) {
+        s->msg = "pages need the LZ4 compressor";
+        return Z_VERSION_ERROR;
+      }
+
+      /* can compress directly on client memory */
+      if (s->avail_out >= s->state->page_size) {
+        done = fastlz_compress_page(s, in, &length, s->next_out,
+                                    s->state->page_size, BLOCK_SIZE(s),
+                                    s->state->level, finish);
+        /* seek output */
+        outSeek(s, done);
+        /* no buffer */
+        s->state->outBuffOffs = s->state->dec_size;
+      }
+      /* otherwise in output buffer */
+      else {
+        if (fastlzlibOutBuff(s) != Z_OK) {
+          s->msg = "memory exhausted";
+          return Z_MEM_ERROR;
+        }
+        done = fastlz_compress_page(s, in, &length, s->state->outBuff,
+                                    s->state->page_size, BLOCK_SIZE(s),
+                                    s->state->level, finish);
+        /* produced size (in outBuff) */
+        s->state->dec_size = done;
+        /* buffered */
+        s->state->outBuffOffs = 0;
+      }
+
+      /* input eaten up to the page capacity ; the remaining data is left on
+         input, or kept at the beginning of inBuff for the next page */
+      if (direct) {
+        inSeek(s, length);
+      } else if (length < in_size) {
+        memmove(s->state->inBuff, &s->state->inBuff[length], in_size - length);
+        s->state->inBuffOffs = in_size - length;
+      }
+      s->state->str_size = 0;
     }
+#endif
     /* compressing */
     else {
       /* note: if < MIN_BLOCK_SIZE, fastlz_compress_hdr will not compress */
-      const uInt estimated_dec_size = in_size + in_size / EXPANSION_RATIO
-        + EXPANSION_SECURITY;
+      const uInt bound = fastlz_compress_hdr_bound(s, in_size, flush_now);
 
-      /* can compress directly on client memory */
-      if (s->avail_out >= estimated_dec_size) {
+      /* can compress directly on client memory (the backend being limited
+         to the available room, if it honors its output limit) */
+      if (s->avail_out >= bound) {
         const int done = fastlz_compress_hdr(s, in, in_size,
-                                             s->next_out, estimated_dec_size,
+                                             s->next_out, s->avail_out,
                                              BLOCK_SIZE(s),
                                              s->state->level,
                                              flush_now);
@@ -900,14 +4233,17 @@ static ZFASTINLINE int fastlzlibProcess(zfast_stream *const s, const int flush,
         /* no buffer */
         s->state->outBuffOffs = s->state->dec_size;
       }
-      /* otherwise in output buffer */
+      /* otherwise in output buffer (allocated, or grown if the compressor
+         changed) */
       else {
-        const int done = fastlz_compress_hdr(s, in, in_size,
-                                             s->state->outBuff,
-                                             BUFFER_BLOCK_SIZE(s),
-                                             BLOCK_SIZE(s),
-                                             s->state->level,
-                                             flush_now);
+        int done;
+        if (fastlzlibOutBuff(s) != Z_OK) {
+          s->msg = "memory exhausted";
+          return Z_MEM_ERROR;
+        }
+        done = fastlz_compress_hdr(s, in, in_size,
+                                   s->state->outBuff, s->state->outBuffSize,
+                                   BLOCK_SIZE(s), s->state->level, flush_now);
         /* produced size (in outBuff) */
         s->state->dec_size = (uInt) done;
         /* buffered */
@@ -928,17 +4264,24 @@ static ZFASTINLINE int fastlzlibProcess(zfast_stream *const s, const int flush,
     }
     /* copy and seek */
     if (size > 0) {
-      memcpy(s->next_out, &s->state->outBuff[s->state->outBuffOffs], size);
+      memcpy(s->next_out, &ZFAST_BUFFERED_OUTPUT(s)[s->state->outBuffOffs],
+             size);
       s->state->outBuffOffs += size;
       outSeek(s, size);
     }
   }
 
+  /* the end of the stream is written: the seek index follows */
+  if (!ZFAST_HAS_BUFFERED_OUTPUT(s)) {
+    fastlzlibIndexTrailer(s);
+  }
+
   /* so far so good */
 
   /* success and EOF */
   if (flush == Z_FINISH
       && ZFAST_INPUT_IS_EMPTY(s)
+      && !ZFAST_HAS_BUFFERED_INPUT(s)
       && !ZFAST_HAS_BUFFERED_OUTPUT(s)) {
     if (!ZFAST_IS_DECOMPRESSING(s)) {
       return Z_STREAM_END;
@@ -962,30 +4305,209 @@ static ZFASTINLINE int fastlzlibProcess2(zfast_stream *const s, const int flush,
                                          const int may_buffer) {
   const uInt prev_avail_in = s->avail_in;
   const uInt prev_avail_out = s->avail_out;
-  const int success = fastlzlibProcess(s, flush, may_buffer);
+  int success = fastlzlibProcess(s, flush, may_buffer);
   const uInt avail_in = s->avail_in;
   const uInt avail_out = s->avail_out;
   /* successful, ate input, no data on output ? */
   if (success == 0
       && avail_out == prev_avail_out && avail_in != prev_avail_in
       && flush != Z_NO_FLUSH) {
-    return fastlzlibProcess(s, flush, may_buffer);
+    success = fastlzlibProcess(s, flush, may_buffer);
+  }
+  /* flushing pages: also flush the data left by the previous page */
+  while(success == Z_OK && flush != Z_NO_FLUSH && ZFAST_IS_PAGED(s)
+        && ZFAST_HAS_BUFFERED_INPUT(s) && !ZFAST_OUTPUT_IS_FULL(s)) {
+    success = fastlzlibProcess(s, flush, may_buffer);
+  }
+  return success;
+}
+
+int fastlzlibDecompress2(zfast_stream *s, int flush, const int may_buffer) {
+  if (ZFAST_IS_DECOMPRESSING(s)) {
+    return fastlzlibProcess2(s, flush, may_buffer);
   } else {
-    return success;
+    s->msg = "decompressing function used with a compressing stream";
+    return Z_STREAM_ERROR;
+  }
+}
+
+int fastlzlibDecompress(zfast_stream *s) {
+  return fastlzlibDecompress2(s, Z_NO_FLUSH, 1);
+}
+
+int fastlzlibDecompressPeek(zfast_stream *s, const Bytef **data, uInt *len) {
+  if (s == NULL || s->state == NULL || data == NULL || len == NULL) {
+    return Z_STREAM_ERROR;
+  }
+  if (!ZFAST_IS_DECOMPRESSING(s)) {
+    s->msg = "decompressing function used with a compressing stream";
+    return Z_STREAM_ERROR;
+  }
+  *data = NULL;
+  *len = 0;
+
+  /* decode until a block with data is pending, without any client output
+     room, so that it lands in outBuff (or is exposed in place if stored) */
+  while (!ZFAST_HAS_BUFFERED_OUTPUT(s)) {
+    Bytef dummy[1];
+    Bytef *const next_out = s->next_out;
+    const uInt avail_out = s->avail_out;
+    int success;
+    s->next_out = dummy;
+    s->avail_out = 0;
+    s->state->peek = 1;
+    success = fastlzlibProcess(s, Z_NO_FLUSH, 1);
+    s->state->peek = 0;
+    s->next_out = next_out;
+    s->avail_out = avail_out;
+    if (success != Z_OK) {
+      return success;
+    }
+  }
+
+  *data = &ZFAST_BUFFERED_OUTPUT(s)[s->state->outBuffOffs];
+  *len = s->state->dec_size - s->state->outBuffOffs;
+  return Z_OK;
+}
+
+int fastlzlibDecompressConsume(zfast_stream *s, uInt length) {
+  if (s == NULL || s->state == NULL) {
+    return Z_STREAM_ERROR;
+  }
+  if (!ZFAST_IS_DECOMPRESSING(s)) {
+    s->msg = "decompressing function used with a compressing stream";
+    return Z_STREAM_ERROR;
+  }
+  if (length > s->state->dec_size - s->state->outBuffOffs) {
+    s->msg = "consuming more than the peeked data";
+    return Z_STREAM_ERROR;
+  }
+  s->state->outBuffOffs += length;
+  s->total_out += length;
+  return Z_OK;
+}
+
+int fastlzlibLoadIndex(zfast_stream *s, const void *data, size_t length) {
+  const Bytef *const in = (const Bytef*) data;
+  const Bytef *footer;
+  const Bytef *block;
+  uInt block_type;
+  uInt block_size;
+  uInt str_size;
+  uInt dec_size;
+  uInt count;
+  uInt size;
+  if (s == NULL || s->state == NULL || ( in == NULL && length != 0 )) {
+    return Z_STREAM_ERROR;
+  }
+  if (!ZFAST_IS_DECOMPRESSING(s)) {
+    s->msg = "decompressing function used with a compressing stream";
+    return Z_STREAM_ERROR;
+  }
+  if (length < INDEX_TRAILER_SIZE(0)) {
+    s->msg = "need more data on input";
+    return Z_BUF_ERROR;
+  }
+
+  /* locator footer, at the very end */
+  footer = &in[length - INDEX_FOOTER_SIZE];
+  if (memcmp(&footer[32], INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0) {
+    s->msg = "corrupted seek index (bad magic)";
+    return Z_DATA_ERROR;
+  }
+  count = READ_32(&footer[16]);
+  if (count > ( length - INDEX_TRAILER_SIZE(0) ) / INDEX_ENTRY_SIZE) {
+    s->msg = "need more data on input";
+    return Z_BUF_ERROR;
+  }
+  size = count * INDEX_ENTRY_SIZE;
+
+  /* index block, preceding the entries */
+  block = footer - size - HEADER_SIZE;
+  fastlz_read_header(block, &block_type, &block_size, &str_size, &dec_size);
+  if (block_type != BLOCK_TYPE_INDEX || str_size != size + INDEX_FOOTER_SIZE
+      || dec_size != 0) {
+    s->msg = "corrupted seek index (illegal index block)";
+    return Z_DATA_ERROR;
+  }
+  if ((uInt) XXH32(&block[HEADER_SIZE], size + 28, 0) != READ_32(&footer[28])) {
+    s->msg = "seek index checksum mismatch";
+    return Z_DATA_ERROR;
+  }
+  if (( footer[24] & ~( ZFAST_CHECKSUM_BLOCK | ZFAST_CHECKSUM_CONTENT
+                        | INDEX_FLAG_DICTIONARY ) ) != 0) {
+    s->msg = "unsupported stream features";
+    return Z_VERSION_ERROR;
+  }
+
+  /* the entries are used in place */
+  s->state->index_table = &block[HEADER_SIZE];
+  s->state->index_entries = count;
+  s->state->index_length = READ_64(&footer[8]);
+  s->state->index_flags = footer[24];
+  s->state->index_dict_id = READ_32(&footer[20]);
+  return (int) count;
+}
+
+int fastlzlibSeek(zfast_stream *s, uint64_t offset,
+                  uint64_t *compressed_offset) {
+  const Bytef *table;
+  uint64_t block_in = 0;
+  uint64_t block_offset = 0;
+  uInt lo;
+  uInt hi;
+  if (s == NULL || s->state == NULL || compressed_offset == NULL) {
+    return Z_STREAM_ERROR;
+  }
+  if (!ZFAST_IS_DECOMPRESSING(s) || s->state->index_table == NULL) {
+    s->msg = "no seek index loaded";
+    return Z_STREAM_ERROR;
+  }
+  if (offset > s->state->index_length) {
+    s->msg = "seeking beyond the end of stream";
+    return Z_STREAM_ERROR;
+  }
+
+  /* the stream information is skipped: check the preset dictionary */
+  if (( s->state->index_flags & INDEX_FLAG_DICTIONARY ) != 0) {
+    if (s->state->backend.dict == NULL) {
+      s->adler = s->state->index_dict_id;
+      s->msg = "need dictionary";
+      return Z_NEED_DICT;
+    } else if (s->state->backend.dict->id != s->state->index_dict_id) {
+      s->msg = "incorrect dictionary";
+      return Z_DATA_ERROR;
+    }
   }
-}
 
-int fastlzlibDecompress2(zfast_stream *s, int flush, const int may_buffer) {
-  if (ZFAST_IS_DECOMPRESSING(s)) {
-    return fastlzlibProcess2(s, flush, may_buffer);
-  } else {
-    s->msg = "decompressing function used with a compressing stream";
-    return Z_STREAM_ERROR;
+  /* last independent block beginning at or before the offset */
+  table = s->state->index_table;
+  lo = 0;
+  hi = s->state->index_entries;
+  while (lo < hi) {
+    const uInt mid = lo + ( hi - lo ) / 2;
+    if (READ_64(&table[mid * INDEX_ENTRY_SIZE + 8]) <= offset) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo != 0) {
+    block_offset = READ_64(&table[( lo - 1 ) * INDEX_ENTRY_SIZE]);
+    block_in = READ_64(&table[( lo - 1 ) * INDEX_ENTRY_SIZE + 8]);
   }
-}
 
-int fastlzlibDecompress(zfast_stream *s) {
-  return fastlzlibDecompress2(s, Z_NO_FLUSH, 1);
+  /* restart decompression at the block, dropping its data up to the offset
+     ; the content checksum can not be verified anymore */
+  fastlzlibReset(s);
+  if (lo != 0) {
+    s->state->flags = s->state->index_flags & ZFAST_CHECKSUM_BLOCK;
+  }
+  s->state->discard = offset - block_in;
+  s->total_in = (uLong) block_offset;
+  s->total_out = (uLong) offset;
+  *compressed_offset = block_offset;
+  return Z_OK;
 }
 
 int fastlzlibCompress2(zfast_stream *s, int flush, const int may_buffer) {
@@ -1001,6 +4523,152 @@ int fastlzlibCompress(zfast_stream *s, int flush) {
   return fastlzlibCompress2(s, flush, 1);
 }
 
+int fastlzlibCompressv(zfast_stream *s, const struct iovec *iov, int iovcnt,
+                       int flush) {
+  /* empty input must still be non-NULL to be processed as a block */
+  static const Bytef empty[1] = { 0 };
+  const uLong start_in = s != NULL ? s->total_in : 0;
+  const uLong start_out = s != NULL ? s->total_out : 0;
+  int success = Z_OK;
+  int i;
+  if (s == NULL || s->state == NULL || iovcnt < 0
+      || ( iov == NULL && iovcnt != 0 )) {
+    return Z_STREAM_ERROR;
+  }
+  if (!ZFAST_IS_COMPRESSING(s)) {
+    s->msg = "compressing function used with a decompressing stream";
+    return Z_STREAM_ERROR;
+  }
+
+  /* input is only taken from the fragments (if none, only flush) */
+  s->next_in = NULL;
+  s->avail_in = 0;
+
+  /* feed each fragment in turn; blocks fully inside a fragment are compressed
+     in place, and only those spanning a boundary are gathered in inBuff */
+  for(i = 0 ; i < iovcnt || i == 0 ; i++) {
+    const Bytef *base = i < iovcnt ? (const Bytef*) iov[i].iov_base : NULL;
+    size_t remaining = i < iovcnt ? iov[i].iov_len : 0;
+    const int last = i + 1 >= iovcnt;
+
+    if (base == NULL) {
+      if (remaining != 0) {
+        return Z_STREAM_ERROR;
+      }
+      base = empty;
+    }
+    /* empty fragments do not need any processing */
+    if (remaining == 0 && !last) {
+      continue;
+    }
+
+    do {
+      /* avail_in is an uInt: split very large fragments */
+      const uInt chunk = remaining > (uInt) -1 ? (uInt) -1 : (uInt) remaining;
+      const int mode = last && chunk == remaining ? flush : Z_NO_FLUSH;
+      s->next_in = (Bytef*) base;
+      s->avail_in = chunk;
+      for(;;) {
+        const uLong prev_in = s->total_in;
+        const uLong prev_out = s->total_out;
+        success = fastlzlibProcess2(s, mode, 1);
+        if (success != Z_OK
+            || ( s->total_in == prev_in && s->total_out == prev_out )
+            || ZFAST_OUTPUT_IS_FULL(s)
+            || ( ZFAST_INPUT_IS_EMPTY(s) && mode == Z_NO_FLUSH )) {
+          break;
+        }
+      }
+      base += chunk - s->avail_in;
+      remaining -= chunk - s->avail_in;
+
+      /* error, end of stream, or output full: let the client resume */
+      if (( success != Z_OK && success != Z_BUF_ERROR )
+          || !ZFAST_INPUT_IS_EMPTY(s)
+          || ZFAST_OUTPUT_IS_FULL(s)) {
+        break;
+      }
+    } while(remaining != 0);
+
+    if (( success != Z_OK && success != Z_BUF_ERROR )
+        || !ZFAST_INPUT_IS_EMPTY(s)
+        || ( ZFAST_OUTPUT_IS_FULL(s) && !last )) {
+      break;
+    }
+  }
+
+  /* fragments belong to the client: do not keep references */
+  s->next_in = NULL;
+  s->avail_in = 0;
+
+  /* a flush having nothing more to do is not an error if we made progress */
+  if (success == Z_BUF_ERROR
+      && ( s->total_in != start_in || s->total_out != start_out )) {
+    success = Z_OK;
+  }
+  return success;
+}
+
+int fastlzlibCompressPage(zfast_stream *s, const void *input, uInt *length,
+                          void *output, uInt page_size) {
+  if (s == NULL || s->state == NULL || !ZFAST_IS_COMPRESSING(s)
+      || length == NULL || ( input == NULL && *length != 0 )
+      || output == NULL) {
+    return Z_STREAM_ERROR;
+  }
+  if (page_size < ZFAST_PAGE_MIN_SIZE || page_size > BLOCK_SIZE(s)) {
+    s->msg = "invalid page size";
+    return Z_STREAM_ERROR;
+  }
+#ifdef ZFAST_USE_LZ4
+  if (s->state->compressor == COMPRESSOR_LZ4) {
+    uInt type;
+    uInt done;
+    int skip;
+    if (fastlzlibBackendPrepare(s) != Z_OK) {
+      s->msg = "memory exhausted";
+      return Z_MEM_ERROR;
+    }
+    if (*length > BLOCK_SIZE(s)) {
+      *length = BLOCK_SIZE(s);
+    }
+    /* the back-off state of the stream is left untouched */
+    skip = *length > MIN_BLOCK_SIZE
+      && fastlzlibIsIncompressible(s, (const Bytef*) input,
+                                   *length < page_size - HEADER_SIZE
+                                   ? *length : page_size - HEADER_SIZE,
+                                   &((Bytef*) output)[HEADER_SIZE],
+                                   page_size - HEADER_SIZE);
+    done = fastlz_compress_page_block(s, (const Bytef*) input, length,
+                                      (Bytef*) output, page_size,
+                                      BLOCK_SIZE(s), s->state->level, 0, skip,
+                                      &type);
+    fastlz_write_padding(&((Bytef*) output)[done], page_size - done,
+                         BLOCK_SIZE(s));
+    return (int) page_size;
+  }
+#endif
+  s->msg = "pages need the LZ4 compressor";
+  return Z_VERSION_ERROR;
+}
+
+int fastlzlibIsIndependentBlock(const void* input, int length) {
+  if (length >= HEADER_SIZE) {
+    uInt block_type;
+    uInt block_size;
+    uInt str_size;
+    uInt dec_size;
+    fastlz_read_header((const Bytef*) input, &block_type, &block_size,
+                       &str_size, &dec_size);
+    if (block_type == BLOCK_TYPE_BAD_MAGIC) {
+      return Z_DATA_ERROR;
+    }
+    return block_type != BLOCK_TYPE_LINKED ? Z_OK : Z_NEED_DICT;
+  } else {
+    return Z_BUF_ERROR;
+  }
+}
+
 int fastlzlibIsCompressedStream(const void* input, int length) {
   if (length >= HEADER_SIZE) {
     const Bytef*const in = (const Bytef*) input;
@@ -1030,25 +4698,33 @@ int fastlzlibDecompressSync(zfast_stream *s) {
       if (s->state->inHdrOffs != 0) {
         s->state->inHdrOffs = 0;
       }
+
+      /* the block being read (or seek index being skipped), if any, is
+         dropped */
+      s->state->str_size = 0;
+      s->state->inBuffOffs = 0;
+      s->state->skip = 0;
+
+      /* previous blocks history is lost, and so is the content checksum */
+      s->state->histOffs = 0;
+      s->state->flags &= ~ZFAST_CHECKSUM_CONTENT;
       
-      /* seek */
-      for( ; s->avail_in >= HEADER_SIZE
-             ; s->state->inHdrOffs++, inSeek(s, 1)) {
-        const Bytef *const in = s->next_in;
-        if (in[0] == BLOCK_MAGIC[0]
-            && in[1] == BLOCK_MAGIC[1]
-            && in[2] == BLOCK_MAGIC[2]
-            && in[3] == BLOCK_MAGIC[3]
-            && in[4] == BLOCK_MAGIC[4]
-            && in[5] == BLOCK_MAGIC[5]
-            && in[6] == BLOCK_MAGIC[6]
-            ) {
-          const int block_size = fastlzlibGetStreamBlockSize(in, HEADER_SIZE);
-          if (block_size != 0) {
-            /* successful seek */
-            return Z_OK;
-          }
+      /* seek to the next independent block: candidates are located by their
+         first magic byte, and their header must be plausible */
+      while (s->avail_in >= HEADER_SIZE) {
+        const uInt scan = s->avail_in - HEADER_SIZE + 1;
+        const Bytef *const found =
+          (const Bytef*) memchr(s->next_in, BLOCK_MAGIC[0], scan);
+        if (found == NULL) {
+          inSeek(s, scan);
+          break;
         }
+        inSeek(s, (uInt) ( found - s->next_in ));
+        if (fastlz_is_sync_header(s, s->next_in, s->avail_in)) {
+          /* successful seek */
+          return Z_OK;
+        }
+        inSeek(s, 1);
       }
       s->msg = "no flush point found";
       return Z_DATA_ERROR;
@@ -1058,3 +4734,757 @@ int fastlzlibDecompressSync(zfast_stream *s) {
     return Z_STREAM_ERROR;
   }
 }
+
+/* block of the stream read by a random-access reader */
+typedef struct zfast_reader_block {
+  /* offset of the block header, and whole block size */
+  uint64_t offset;
+  uInt size;
+  /* uncompressed offset and size */
+  uint64_t position;
+  uInt length;
+  /* independent block starting the chain needed to decode this one */
+  uInt keyframe;
+} zfast_reader_block;
+
+/* decoded block kept in the cache */
+typedef struct zfast_reader_entry {
+  /* block number, and references (the cache, and readers copying it) */
+  uInt block;
+  uInt refs;
+  /* decoded data */
+  Bytef *data;
+  uInt length;
+  /* shard LRU list, most recently used first */
+  struct zfast_reader_entry *prev;
+  struct zfast_reader_entry *next;
+} zfast_reader_entry;
+
+/* shard of the cache, holding the blocks whose number modulo the number of
+   shards is the shard number */
+typedef struct zfast_reader_shard {
+  zfast_reader_entry *head;
+  zfast_reader_entry *tail;
+  /* decoded bytes held, and maximum */
+  size_t used;
+  size_t capacity;
+#if defined(ZFAST_USE_THREADS)
+  pthread_mutex_t lock;
+#elif defined(_WIN32)
+  CRITICAL_SECTION lock;
+#endif
+} zfast_reader_shard;
+
+struct zfast_reader {
+  /* compressed stream, and its mapping if owned (fastlzlibReaderOpenFd()) */
+  const Bytef *data;
+  size_t length;
+  void *map;
+  /* leading stream information block, fed to decoders first */
+  uInt info_size;
+  /* blocks holding data, largest uncompressed block, and uncompressed
+     size */
+  zfast_reader_block *blocks;
+  uInt nb_blocks;
+  uInt max_length;
+  uint64_t size;
+  /* decoding streams (shared with readers using the same block size and
+     compressor), and preset dictionary */
+  zfast_pool *pool;
+  const zfast_dictionary *dict;
+  /* cached entry of each block (if any), and cache shards in use */
+  zfast_reader_entry **entries;
+  zfast_reader_shard shards[READER_SHARDS];
+  uInt nb_shards;
+  /* end of the last reads of sequential readers (readahead hints), and the
+     next hint to be replaced */
+  uint64_t hints[READER_STREAMS];
+  uInt next_hint;
+#if defined(ZFAST_USE_THREADS)
+  pthread_mutex_t lock;
+#elif defined(_WIN32)
+  CRITICAL_SECTION lock;
+#endif
+};
+
+#if defined(ZFAST_USE_THREADS)
+/* decoding streams pool shared by the readers of a block size and
+   compressor */
+typedef struct zfast_reader_pool {
+  zfast_pool *pool;
+  int block_size;
+  zfast_stream_compressor compressor;
+  uInt refs;
+  struct zfast_reader_pool *next;
+} zfast_reader_pool;
+
+/* readahead request */
+typedef struct zfast_reader_request {
+  zfast_reader *reader;
+  uInt block;
+} zfast_reader_request;
+
+/* state shared by all readers, protected by reader_lock: decoding pools,
+   open readers, and the readahead thread (started upon the first request,
+   and stopped when the last reader is closed) with its pending requests and
+   the reader of the request being processed */
+static pthread_mutex_t reader_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reader_wakeup = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t reader_done = PTHREAD_COND_INITIALIZER;
+static zfast_reader_pool *reader_pools = NULL;
+static uInt reader_count = 0;
+static pthread_t reader_thread;
+static int reader_started = 0;
+static int reader_stop = 0;
+static zfast_reader_request reader_queue[READER_AHEAD_QUEUE];
+static uInt reader_queued = 0;
+static const zfast_reader *reader_busy = NULL;
+#endif
+
+/* remove an entry from its shard list */
+static ZFASTINLINE void fastlzlibReaderUnlink(zfast_reader_shard *shard,
+                                             zfast_reader_entry *e) {
+  if (e->prev != NULL) {
+    e->prev->next = e->next;
+  } else {
+    shard->head = e->next;
+  }
+  if (e->next != NULL) {
+    e->next->prev = e->prev;
+  } else {
+    shard->tail = e->prev;
+  }
+  e->prev = e->next = NULL;
+}
+
+/* insert an entry at the head of its shard list */
+static ZFASTINLINE void fastlzlibReaderLink(zfast_reader_shard *shard,
+                                           zfast_reader_entry *e) {
+  e->prev = NULL;
+  e->next = shard->head;
+  if (shard->head != NULL) {
+    shard->head->prev = e;
+  } else {
+    shard->tail = e;
+  }
+  shard->head = e;
+}
+
+/* drop a reference to an entry (the shard being locked) ; returns the entry
+   to be freed by the caller, once unlocked, or NULL */
+static ZFASTINLINE zfast_reader_entry*
+fastlzlibReaderUnref(zfast_reader_entry *e) {
+  return --e->refs == 0 ? e : NULL;
+}
+
+/* referenced cached entry of a block, or NULL */
+static zfast_reader_entry* fastlzlibReaderLookup(zfast_reader *r, uInt block) {
+  zfast_reader_shard *const shard = &r->shards[block % r->nb_shards];
+  zfast_reader_entry *e;
+  POOL_LOCK(shard);
+  e = r->entries[block];
+  if (e != NULL) {
+    e->refs++;
+    if (e != shard->head) {
+      fastlzlibReaderUnlink(shard, e);
+      fastlzlibReaderLink(shard, e);
+    }
+  }
+  POOL_UNLOCK(shard);
+  return e;
+}
+
+/* give back an entry returned by fastlzlibReaderLookup() or
+   fastlzlibReaderInsert() */
+static void fastlzlibReaderRelease(zfast_reader *r, zfast_reader_entry *e) {
+  zfast_reader_shard *const shard = &r->shards[e->block % r->nb_shards];
+  zfast_reader_entry *unused;
+  POOL_LOCK(shard);
+  unused = fastlzlibReaderUnref(e);
+  POOL_UNLOCK(shard);
+  if (unused != NULL) {
+    default_zfree(unused);
+  }
+}
+
+/* insert a decoded block in the cache, evicting the least recently used
+   ones of its shard (the entry inserted is always kept) ; returns the
+   referenced entry of the block, which may be another one decoded
+   concurrently (the new entry is then freed) */
+static zfast_reader_entry* fastlzlibReaderInsert(zfast_reader *r,
+                                                 zfast_reader_entry *e) {
+  zfast_reader_shard *const shard = &r->shards[e->block % r->nb_shards];
+  zfast_reader_entry *evicted = NULL;
+  zfast_reader_entry *found;
+  POOL_LOCK(shard);
+  found = r->entries[e->block];
+  if (found == NULL) {
+    /* one reference for the cache, and one for the caller */
+    e->refs = 2;
+    r->entries[e->block] = e;
+    fastlzlibReaderLink(shard, e);
+    shard->used += e->length;
+    /* evicted entries are chained through "next" to be freed, unless still
+       being copied */
+    while (shard->used > shard->capacity && shard->tail != e) {
+      zfast_reader_entry *const last = shard->tail;
+      fastlzlibReaderUnlink(shard, last);
+      r->entries[last->block] = NULL;
+      shard->used -= last->length;
+      if (fastlzlibReaderUnref(last) != NULL) {
+        last->next = evicted;
+        evicted = last;
+      }
+    }
+    found = e;
+    e = NULL;
+  } else {
+    found->refs++;
+  }
+  POOL_UNLOCK(shard);
+  while (evicted != NULL) {
+    zfast_reader_entry *const next = evicted->next;
+    default_zfree(evicted);
+    evicted = next;
+  }
+  if (e != NULL) {
+    default_zfree(e);
+  }
+  return found;
+}
+
+/* decode a whole block ("size" bytes at "in", header included) to "out"
+   ("length" bytes) */
+static int fastlzlibReaderDecodeBlock(zfast_stream *s, const Bytef *in,
+                                      uInt size, Bytef *out, uInt length) {
+  int code;
+  s->next_in = (Bytef*) in;
+  s->avail_in = size;
+  s->next_out = out;
+  s->avail_out = length;
+  code = fastlzlibDecompress2(s, Z_NO_FLUSH, 0);
+  if (code == Z_OK && ( s->avail_in != 0 || s->avail_out != 0 )) {
+    s->msg = "corrupted compressed stream";
+    code = Z_DATA_ERROR;
+  }
+  return code;
+}
+
+/* decode a block, and the previous ones of its chain, into the cache ;
+   returns the referenced entry of the block, or NULL upon error ("*code") */
+static zfast_reader_entry* fastlzlibReaderDecode(zfast_reader *r, uInt block,
+                                                 int *code) {
+  zfast_reader_entry *result = NULL;
+  zfast_stream *const s = fastlzlibPoolAcquire(r->pool);
+  uInt i;
+  if (s == NULL) {
+    *code = Z_MEM_ERROR;
+    return NULL;
+  }
+  *code = Z_OK;
+  if (r->dict != NULL) {
+    *code = fastlzlibAttachDictionary(s, r->dict);
+  }
+  /* the stream information declares the checksums and the dictionary ; the
+     content checksum can not be verified */
+  if (*code == Z_OK && r->info_size != 0) {
+    *code = fastlzlibReaderDecodeBlock(s, r->data, r->info_size, NULL, 0);
+  }
+  s->state->flags &= ~ZFAST_CHECKSUM_CONTENT;
+  for(i = r->blocks[block].keyframe ; *code == Z_OK && i <= block ; i++) {
+    const zfast_reader_block *const b = &r->blocks[i];
+    zfast_reader_entry *e = (zfast_reader_entry*)
+      default_zalloc(sizeof(zfast_reader_entry) + b->length, 1);
+    if (e == NULL) {
+      *code = Z_MEM_ERROR;
+      break;
+    }
+    memset(e, 0, sizeof(zfast_reader_entry));
+    e->block = i;
+    e->data = (Bytef*) &e[1];
+    e->length = b->length;
+    *code = fastlzlibReaderDecodeBlock(s, &r->data[b->offset], b->size,
+                                       e->data, e->length);
+    if (*code != Z_OK) {
+      default_zfree(e);
+      break;
+    }
+    e = fastlzlibReaderInsert(r, e);
+    if (i == block) {
+      result = e;
+    } else {
+      fastlzlibReaderRelease(r, e);
+    }
+  }
+  fastlzlibPoolRelease(r->pool, s);
+  return result;
+}
+
+/* referenced entry of a block, decoded if not cached, or NULL upon error
+   ("*code") */
+static zfast_reader_entry* fastlzlibReaderGet(zfast_reader *r, uInt block,
+                                              int *code) {
+  zfast_reader_entry *const e = fastlzlibReaderLookup(r, block);
+  if (e != NULL) {
+    return e;
+  }
+  return fastlzlibReaderDecode(r, block, code);
+}
+
+#if defined(ZFAST_USE_THREADS)
+/* readahead thread: decode the blocks requested by sequential readers */
+static void* fastlzlibReaderAhead(void *arg) {
+  (void) arg;
+  pthread_mutex_lock(&reader_lock);
+  for(;;) {
+    zfast_reader_request request;
+    zfast_reader_entry *e;
+    int code;
+    while(!reader_stop && reader_queued == 0) {
+      pthread_cond_wait(&reader_wakeup, &reader_lock);
+    }
+    if (reader_stop) {
+      break;
+    }
+    request = reader_queue[0];
+    memmove(&reader_queue[0], &reader_queue[1],
+            --reader_queued * sizeof(zfast_reader_request));
+    reader_busy = request.reader;
+    pthread_mutex_unlock(&reader_lock);
+    e = fastlzlibReaderGet(request.reader, request.block, &code);
+    if (e != NULL) {
+      fastlzlibReaderRelease(request.reader, e);
+    }
+    pthread_mutex_lock(&reader_lock);
+    reader_busy = NULL;
+    pthread_cond_broadcast(&reader_done);
+  }
+  pthread_mutex_unlock(&reader_lock);
+  return NULL;
+}
+#endif
+
+/* is the read of "len" bytes at "offset" following a previous one ? the end
+   of the last reads of up to READER_STREAMS sequential readers are kept */
+static int fastlzlibReaderSequential(zfast_reader *r, uint64_t offset,
+                                     uInt len) {
+  int sequential = 0;
+  uInt i;
+  POOL_LOCK(r);
+  for(i = 0 ; i < READER_STREAMS && r->hints[i] != offset ; i++) ;
+  if (i < READER_STREAMS) {
+    sequential = 1;
+  } else {
+    i = r->next_hint;
+    r->next_hint = ( r->next_hint + 1 ) % READER_STREAMS;
+  }
+  r->hints[i] = offset + len;
+  POOL_UNLOCK(r);
+  return sequential;
+}
+
+/* request the readahead of a block (ignored without thread support, or if
+   too many requests are pending) */
+static void fastlzlibReaderAheadRequest(zfast_reader *r, uInt block) {
+#if defined(ZFAST_USE_THREADS)
+  uInt i;
+  pthread_mutex_lock(&reader_lock);
+  if (!reader_started && !reader_stop) {
+    reader_started = pthread_create(&reader_thread, NULL,
+                                    fastlzlibReaderAhead, NULL) == 0;
+  }
+  for(i = 0 ; i < reader_queued && ( reader_queue[i].reader != r
+                                     || reader_queue[i].block != block )
+        ; i++) ;
+  if (reader_started && i == reader_queued
+      && reader_queued < READER_AHEAD_QUEUE) {
+    reader_queue[reader_queued].reader = r;
+    reader_queue[reader_queued].block = block;
+    reader_queued++;
+    pthread_cond_signal(&reader_wakeup);
+  }
+  pthread_mutex_unlock(&reader_lock);
+#else
+  (void) r;
+  (void) block;
+#endif
+}
+
+/* get a decoding streams pool (NULL upon error) */
+static zfast_pool* fastlzlibReaderPoolGet(int block_size,
+                                          zfast_stream_compressor
+                                          compressor) {
+#if defined(ZFAST_USE_THREADS)
+  zfast_reader_pool *p;
+  pthread_mutex_lock(&reader_lock);
+  for(p = reader_pools ; p != NULL && ( p->block_size != block_size
+                                        || p->compressor != compressor )
+        ; p = p->next) ;
+  if (p == NULL) {
+    p = (zfast_reader_pool*) default_zalloc(sizeof(zfast_reader_pool), 1);
+    if (p != NULL) {
+      memset(p, 0, sizeof(zfast_reader_pool));
+      p->pool = fastlzlibPoolCreate(ZFAST_POOL_DECOMPRESS, block_size,
+                                    compressor);
+      if (p->pool == NULL) {
+        default_zfree(p);
+        p = NULL;
+      } else {
+        p->block_size = block_size;
+        p->compressor = compressor;
+        p->next = reader_pools;
+        reader_pools = p;
+      }
+    }
+  }
+  if (p != NULL) {
+    p->refs++;
+  }
+  pthread_mutex_unlock(&reader_lock);
+  return p != NULL ? p->pool : NULL;
+#else
+  return fastlzlibPoolCreate(ZFAST_POOL_DECOMPRESS, block_size, compressor);
+#endif
+}
+
+/* give back a pool returned by fastlzlibReaderPoolGet() */
+static void fastlzlibReaderPoolPut(zfast_pool *pool) {
+#if defined(ZFAST_USE_THREADS)
+  zfast_reader_pool **link;
+  zfast_reader_pool *unused = NULL;
+  pthread_mutex_lock(&reader_lock);
+  for(link = &reader_pools ; (*link)->pool != pool ; link = &(*link)->next) ;
+  if (--(*link)->refs == 0) {
+    unused = *link;
+    *link = unused->next;
+  }
+  pthread_mutex_unlock(&reader_lock);
+  if (unused != NULL) {
+    fastlzlibPoolDestroy(unused->pool);
+    default_zfree(unused);
+  }
+#else
+  fastlzlibPoolDestroy(pool);
+#endif
+}
+
+/* build the block map by walking the block headers of the stream */
+static int fastlzlibReaderMap(zfast_reader *r) {
+  uInt capacity = 0;
+  uInt keyframe = 0;
+  uint64_t offset = 0;
+  for(;;) {
+    const Bytef *const in = &r->data[offset];
+    uInt compressed_size;
+    uInt uncompressed_size;
+    uInt size;
+    if (r->length - offset < HEADER_SIZE) {
+      return Z_BUF_ERROR;
+    }
+    if (fastlzlibGetStreamInfo(in, HEADER_SIZE, &compressed_size,
+                               &uncompressed_size) != Z_OK) {
+      return Z_DATA_ERROR;
+    }
+    /* EOF marker (a seek index may follow) */
+    if (compressed_size == 0 && uncompressed_size == 0) {
+      return Z_OK;
+    }
+    if (r->length - offset - HEADER_SIZE < compressed_size) {
+      return Z_BUF_ERROR;
+    }
+    size = HEADER_SIZE + compressed_size;
+    /* stream information, at the beginning, or padding */
+    if (uncompressed_size == 0) {
+      if (offset == 0) {
+        r->info_size = size;
+      }
+    }
+    /* data block */
+    else {
+      zfast_reader_block *b;
+      if (r->nb_blocks == capacity) {
+        zfast_reader_block *const blocks = (zfast_reader_block*)
+          default_zalloc(sizeof(zfast_reader_block),
+                         capacity != 0 ? capacity * 2 : 256);
+        if (blocks == NULL) {
+          return Z_MEM_ERROR;
+        }
+        if (r->blocks != NULL) {
+          memcpy(blocks, r->blocks, r->nb_blocks * sizeof(zfast_reader_block));
+          default_zfree(r->blocks);
+        }
+        r->blocks = blocks;
+        capacity = capacity != 0 ? capacity * 2 : 256;
+      }
+      if (fastlzlibIsIndependentBlock(in, size) == Z_OK) {
+        keyframe = r->nb_blocks;
+      }
+      b = &r->blocks[r->nb_blocks++];
+      b->offset = offset;
+      b->size = size;
+      b->position = r->size;
+      b->length = uncompressed_size;
+      b->keyframe = keyframe;
+      r->size += uncompressed_size;
+      if (uncompressed_size > r->max_length) {
+        r->max_length = uncompressed_size;
+      }
+    }
+    offset += size;
+  }
+}
+
+/* map a file in memory (NULL upon error) */
+static void* fastlzlibReaderMapFile(int fd, size_t *length) {
+#if defined(_WIN32)
+  const HANDLE file = (HANDLE) _get_osfhandle(fd);
+  LARGE_INTEGER size;
+  HANDLE mapping;
+  void *map;
+  if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &size)
+      || size.QuadPart == 0 || (uint64_t) size.QuadPart > (size_t) -1) {
+    return NULL;
+  }
+  mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (mapping == NULL) {
+    return NULL;
+  }
+  /* the view keeps the mapping alive */
+  map = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  CloseHandle(mapping);
+  *length = (size_t) size.QuadPart;
+  return map;
+#else
+  struct stat st;
+  void *map;
+  if (fstat(fd, &st) != 0 || st.st_size <= 0
+      || (uint64_t) st.st_size > (size_t) -1) {
+    return NULL;
+  }
+  map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    return NULL;
+  }
+  *length = (size_t) st.st_size;
+  return map;
+#endif
+}
+
+/* unmap a file mapped by fastlzlibReaderMapFile() */
+static void fastlzlibReaderUnmapFile(void *map, size_t length) {
+#if defined(_WIN32)
+  (void) length;
+  UnmapViewOfFile(map);
+#else
+  munmap(map, length);
+#endif
+}
+
+zfast_reader* fastlzlibReaderOpen(const void *data, size_t length,
+                                  zfast_stream_compressor compressor,
+                                  const zfast_dictionary *dict,
+                                  size_t cache_size) {
+  zfast_reader *r;
+  int block_size;
+  uInt i;
+  if (data == NULL) {
+    return NULL;
+  }
+  block_size = fastlzlibGetStreamBlockSize(data, length < HEADER_SIZE
+                                           ? (int) length : HEADER_SIZE);
+  if (block_size == 0) {
+    return NULL;
+  }
+  r = (zfast_reader*) default_zalloc(sizeof(zfast_reader), 1);
+  if (r == NULL) {
+    return NULL;
+  }
+  memset(r, 0, sizeof(zfast_reader));
+  r->data = (const Bytef*) data;
+  r->length = length;
+  r->dict = dict;
+  if (fastlzlibReaderMap(r) != Z_OK
+      || ( r->entries = (zfast_reader_entry**)
+           default_zalloc(sizeof(zfast_reader_entry*),
+                          r->nb_blocks + 1) ) == NULL
+      || ( r->pool = fastlzlibReaderPoolGet(block_size, compressor) )
+      == NULL) {
+    default_zfree(r->entries);
+    default_zfree(r->blocks);
+    default_zfree(r);
+    return NULL;
+  }
+  memset(r->entries, 0, sizeof(zfast_reader_entry*) * ( r->nb_blocks + 1 ));
+  if (cache_size == 0) {
+    cache_size = READER_CACHE_SIZE;
+  }
+  /* each shard keeps at least the block last inserted: the budget is split
+     into shards holding at least the largest block */
+  r->nb_shards = r->max_length != 0 ? (uInt) ( cache_size / r->max_length )
+    : READER_SHARDS;
+  if (r->nb_shards > READER_SHARDS) {
+    r->nb_shards = READER_SHARDS;
+  } else if (r->nb_shards == 0) {
+    r->nb_shards = 1;
+  }
+  for(i = 0 ; i < READER_SHARDS ; i++) {
+    r->shards[i].capacity = cache_size / r->nb_shards;
+#if defined(ZFAST_USE_THREADS)
+    pthread_mutex_init(&r->shards[i].lock, NULL);
+#elif defined(_WIN32)
+    InitializeCriticalSection(&r->shards[i].lock);
+#endif
+  }
+  for(i = 0 ; i < READER_STREAMS ; i++) {
+    r->hints[i] = (uint64_t) -1;
+  }
+#if defined(ZFAST_USE_THREADS)
+  pthread_mutex_init(&r->lock, NULL);
+  pthread_mutex_lock(&reader_lock);
+  reader_count++;
+  pthread_mutex_unlock(&reader_lock);
+#elif defined(_WIN32)
+  InitializeCriticalSection(&r->lock);
+#endif
+  return r;
+}
+
+zfast_reader* fastlzlibReaderOpenFd(int fd,
+                                    zfast_stream_compressor compressor,
+                                    const zfast_dictionary *dict,
+                                    size_t cache_size) {
+  size_t length;
+  void *const map = fastlzlibReaderMapFile(fd, &length);
+  zfast_reader *r;
+  if (map == NULL) {
+    return NULL;
+  }
+  r = fastlzlibReaderOpen(map, length, compressor, dict, cache_size);
+  if (r == NULL) {
+    fastlzlibReaderUnmapFile(map, length);
+    return NULL;
+  }
+  r->map = map;
+  return r;
+}
+
+uint64_t fastlzlibReaderSize(const zfast_reader *r) {
+  return r != NULL ? r->size : 0;
+}
+
+int fastlzlibPread(zfast_reader *r, void *buf, uInt len, uint64_t offset) {
+  Bytef *const out = (Bytef*) buf;
+  uInt done = 0;
+  uInt block;
+  uInt lo;
+  uInt hi;
+  if (r == NULL || ( buf == NULL && len != 0 ) || len > 0x7fffffff) {
+    return Z_STREAM_ERROR;
+  }
+  if (offset >= r->size || len == 0) {
+    return 0;
+  }
+  if (len > r->size - offset) {
+    len = (uInt) ( r->size - offset );
+  }
+
+  /* block holding the offset */
+  lo = 0;
+  hi = r->nb_blocks;
+  while (hi - lo > 1) {
+    const uInt mid = lo + ( hi - lo ) / 2;
+    if (r->blocks[mid].position <= offset) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+
+  /* copy the blocks covering the range */
+  for(block = lo ; done < len ; block++) {
+    const zfast_reader_block *const b = &r->blocks[block];
+    const uInt within = (uInt) ( offset + done - b->position );
+    uInt size = b->length - within;
+    int code;
+    zfast_reader_entry *const e = fastlzlibReaderGet(r, block, &code);
+    if (e == NULL) {
+      return code;
+    }
+    if (size > len - done) {
+      size = len - done;
+    }
+    memcpy(&out[done], &e->data[within], size);
+    fastlzlibReaderRelease(r, e);
+    done += size;
+  }
+
+  /* a read following a previous one is sequential: the next block is read
+     ahead */
+  if (fastlzlibReaderSequential(r, offset, len) && block < r->nb_blocks) {
+    fastlzlibReaderAheadRequest(r, block);
+  }
+
+  return (int) done;
+}
+
+void fastlzlibReaderClose(zfast_reader *r) {
+  uInt i;
+  if (r == NULL) {
+    return;
+  }
+#if defined(ZFAST_USE_THREADS)
+  {
+    int stop = 0;
+    uInt j = 0;
+    /* drop the pending requests of the reader, and wait for the one being
+       processed */
+    pthread_mutex_lock(&reader_lock);
+    for(i = 0 ; i < reader_queued ; i++) {
+      if (reader_queue[i].reader != r) {
+        reader_queue[j++] = reader_queue[i];
+      }
+    }
+    reader_queued = j;
+    while(reader_busy == r) {
+      pthread_cond_wait(&reader_done, &reader_lock);
+    }
+    /* the last reader stops the readahead thread (not restarted until it
+       exits) */
+    if (--reader_count == 0 && reader_started) {
+      reader_started = 0;
+      reader_stop = stop = 1;
+      pthread_cond_signal(&reader_wakeup);
+    }
+    pthread_mutex_unlock(&reader_lock);
+    if (stop) {
+      pthread_join(reader_thread, NULL);
+      pthread_mutex_lock(&reader_lock);
+      reader_stop = 0;
+      pthread_mutex_unlock(&reader_lock);
+    }
+  }
+  pthread_mutex_destroy(&r->lock);
+#elif defined(_WIN32)
+  DeleteCriticalSection(&r->lock);
+#endif
+  for(i = 0 ; i < READER_SHARDS ; i++) {
+    zfast_reader_entry *e = r->shards[i].head;
+    while(e != NULL) {
+      zfast_reader_entry *const next = e->next;
+      default_zfree(e);
+      e = next;
+    }
+#if defined(ZFAST_USE_THREADS)
+    pthread_mutex_destroy(&r->shards[i].lock);
+#elif defined(_WIN32)
+    DeleteCriticalSection(&r->shards[i].lock);
+#endif
+  }
+  fastlzlibReaderPoolPut(r->pool);
+  if (r->map != NULL) {
+    fastlzlibReaderUnmapFile(r->map, r->length);
+  }
+  default_zfree(r->entries);
+  default_zfree(r->blocks);
+  default_zfree(r);
+}
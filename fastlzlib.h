@@ -51,11 +51,24 @@
 /* we are using only zlib types and defines, including z_stream_s */
 #define NO_DUMMY_DECL
 #include "zlib.h"
+#include <stddef.h>
+#include <stdint.h>
+#ifndef _WIN32
+#include <sys/uio.h>
+#endif
 
 #if defined (__cplusplus)
 extern "C" {
 #endif
 
+#ifdef _WIN32
+/* scatter/gather fragment, as in POSIX <sys/uio.h> */
+struct iovec {
+  void *iov_base;
+  size_t iov_len;
+};
+#endif
+
 /**
  * The zfast structure is identical to zlib one, except for the "state" opaque
  * member.
@@ -72,17 +85,199 @@ typedef enum zfast_stream_compressor {
   COMPRESSOR_FASTLZ,
   COMPRESSOR_LZ4,
   COMPRESSOR_LZFSE,
+  /**
+   * Adaptive compressor: each block is compressed with the built-in
+   * compressor (FastLZ level 1 or 2, LZ4 fast or high compression) giving
+   * the best ratio among those meeting the minimum speed (OPTION_MIN_SPEED),
+   * according to running estimations refreshed periodically, or when the
+   * data changes. Blocks are tagged (OPTION_TAGGED_BLOCKS).
+   **/
+  COMPRESSOR_AUTO,
   COMPRESSOR_DEFAULT = COMPRESSOR_FASTLZ
 } zfast_stream_compressor;
 
+/**
+ * Digested preset dictionary (opaque), which can be shared by several
+ * streams, including from different threads.
+ **/
+typedef struct zfast_dictionary zfast_dictionary;
+
+/**
+ * Kind of memory requested to a stream allocator (see zfast_allocator).
+ **/
+typedef enum zfast_alloc_hint {
+  /**
+   * Stream state, compressor contexts and dictionaries: allocated once, from
+   * a few hundred bytes to a few hundred kilobytes.
+   **/
+  ZFAST_ALLOC_CONTEXT,
+  /**
+   * Data buffers, about the size of a block (up to 32MB), touched at each
+   * block.
+   **/
+  ZFAST_ALLOC_BUFFER
+} zfast_alloc_hint;
+
+/**
+ * Stream allocator (see fastlzlibSetAllocator()).
+ * "allocate" returns "size" bytes aligned on "alignment" (a power of two),
+ * or NULL upon error ; "hint" is a zfast_alloc_hint. "deallocate" is given
+ * the same size and alignment. Both are given "opaque".
+ **/
+typedef struct zfast_allocator {
+  void* (*allocate)(void *opaque, size_t size, size_t alignment, int hint);
+  void (*deallocate)(void *opaque, void *address, size_t size,
+                     size_t alignment);
+  void *opaque;
+} zfast_allocator;
+
+/**
+ * Pool of streams (opaque), which can be shared by several threads (see
+ * fastlzlibPoolCreate()).
+ **/
+typedef struct zfast_pool zfast_pool;
+
+/**
+ * Random-access reader of a compressed stream (opaque), which can be shared
+ * by several threads (see fastlzlibReaderOpen()).
+ **/
+typedef struct zfast_reader zfast_reader;
+
+/**
+ * Stream options (see fastlzlibSetOption())
+ **/
+typedef enum zfast_stream_option {
+  /**
+   * Compressing: if non zero, LZ4 blocks are linked, that is, compressed
+   * using the previous 64KB of data as history, which greatly improves the
+   * compression ratio of small blocks. The option is ignored by other
+   * compressors. Default is zero (independent blocks).
+   * Streams using linked blocks can not be read by older versions of the
+   * library.
+   **/
+  OPTION_LINKED_BLOCKS,
+  /**
+   * Compressing: when linked blocks are enabled, emit an independent
+   * ("keyframe") block every n blocks, so that fastlzlibDecompressSync() and
+   * seeking can restart decompression without the previous blocks. Zero
+   * means that only the first block, and blocks following a Z_FULL_FLUSH,
+   * are keyframes. Default is 64.
+   **/
+  OPTION_KEYFRAME_INTERVAL,
+  /**
+   * Compressing: if non zero, compressed blocks are tagged with the
+   * compressor used, so that decompressing streams do not need to be told
+   * the compressor in advance through fastlzlibSetCompressor(). Changing the
+   * compressor of a stream after some data was compressed enables this
+   * option. Default is zero (untagged blocks, readable by older versions of
+   * the library).
+   **/
+  OPTION_TAGGED_BLOCKS,
+  /**
+   * Compressing: minimum compression speed, in MB/s, of the adaptive
+   * compressor (COMPRESSOR_AUTO). Default is zero (best ratio).
+   **/
+  OPTION_MIN_SPEED,
+  /**
+   * Compressing: if non zero, blocks looking incompressible (signature of a
+   * compressed format or high entropy, confirmed by the trial compression
+   * of a small slice) are stored without invoking the compressor. Default
+   * is non zero.
+   **/
+  OPTION_DETECT_INCOMPRESSIBLE,
+  /**
+   * Compressing: minimum gain, in percent (0..99), for a block to be stored
+   * compressed rather than raw. Default is zero (any gain).
+   **/
+  OPTION_MIN_GAIN,
+  /**
+   * Compressing: after repeated incompressible blocks, store the n next
+   * blocks without trying to compress them. Default is zero (never back off).
+   **/
+  OPTION_BACKOFF_BLOCKS,
+  /**
+   * Compressing: if non zero, the stream is emitted as pages of exactly n
+   * bytes (within [ZFAST_PAGE_MIN_SIZE .. block size]), each holding a
+   * single block compressed to fill the page as much as possible, followed
+   * by padding (the first and last pages also hold the stream information
+   * and the EOF marker). The LZ4 compressor is required; blocks are not
+   * linked, and fast levels do not use the dictionary nor accelerations.
+   * Streams using pages can be read by any version of the library reading
+   * stream information blocks. Default is zero (no pages).
+   * See also fastlzlibCompressPage().
+   **/
+  OPTION_PAGE_SIZE,
+  /**
+   * Compressing: checksums written in the stream, a combination of
+   * ZFAST_CHECKSUM_BLOCK and ZFAST_CHECKSUM_CONTENT, to be set before the
+   * first block is compressed. Streams using checksums can only be read by
+   * versions of the library supporting them. Default is zero (none).
+   **/
+  OPTION_CHECKSUMS,
+  /**
+   * Decompressing: if zero, checksums found in the stream are not verified
+   * (trusted input). Default is non zero.
+   **/
+  OPTION_VERIFY_CHECKSUMS,
+  /**
+   * Compressing: if non zero, a seek index locating the independent blocks
+   * (compressed and uncompressed offsets) is written after the EOF marker
+   * upon Z_FINISH, ended by a fixed-size footer, to be set before the first
+   * block is compressed. Decompressing streams skip it ; older versions of
+   * the library stop at the EOF marker. Default is zero (no index).
+   * See also fastlzlibLoadIndex() and fastlzlibSeek().
+   **/
+  OPTION_INDEX
+} zfast_stream_option;
+
+/**
+ * Checksum flags (see OPTION_CHECKSUMS).
+ * ZFAST_CHECKSUM_BLOCK: XXH32 of the stored data of each block.
+ * ZFAST_CHECKSUM_CONTENT: XXH64 of the whole uncompressed content, before the
+ * EOF marker.
+ **/
+#define ZFAST_CHECKSUM_BLOCK   (0x01)
+#define ZFAST_CHECKSUM_CONTENT (0x02)
+
+/**
+ * Minimum page size (see OPTION_PAGE_SIZE).
+ **/
+#define ZFAST_PAGE_MIN_SIZE 512
+
+/**
+ * Fastest compression level.
+ * Besides the zlib levels (Z_BEST_SPEED .. Z_BEST_COMPRESSION, and
+ * Z_DEFAULT_COMPRESSION), levels from -2 down to ZFAST_LEVEL_FASTEST trade
+ * compression ratio for speed.
+ * With LZ4, negative levels use the fast compressor with an acceleration of
+ * -level, levels 0 and 1 use the fast compressor, levels 2 to 6 use the high
+ * compression mode, and levels 7 to 9 use the optimal parser.
+ * With FastLZ, levels up to Z_BEST_SPEED use FastLZ level 1, and higher levels
+ * use FastLZ level 2.
+ **/
+#define ZFAST_LEVEL_FASTEST (-64)
+
+/**
+ * Level of pools of decompressing streams (see fastlzlibPoolCreate()).
+ **/
+#define ZFAST_POOL_DECOMPRESS (ZFAST_LEVEL_FASTEST - 1)
+
 /**
  * Return the fastlz library version.
  * (zlib equivalent: zlibVersion)
  **/
 ZFASTEXTERN const char * fastlzlibVersion(void);
 
+/**
+ * Return the name of the CPU-specific variant of the compression kernels,
+ * selected at run time: "avx2", "sse2" or "generic".
+ **/
+ZFASTEXTERN const char * fastlzlibVariant(void);
+
 /**
  * Initialize a compressing stream.
+ * The level is within the [ZFAST_LEVEL_FASTEST .. Z_BEST_COMPRESSION] range,
+ * or Z_DEFAULT_COMPRESSION.
  * Returns Z_OK upon success, Z_MEM_ERROR upon memory allocation error.
  * (zlib equivalent: deflateInit)
  **/
@@ -108,6 +303,8 @@ ZFASTEXTERN int fastlzlibDecompressInit(zfast_stream *s);
  * Initialize a decompressing stream, and set the block size to "block_size".
  * The block size MUST be a power of two, and be within the
  * [1024 .. 33554432] interval
+ * The block size is only a hint: the stream block size is learnt from the
+ * first block header, and followed if larger blocks are met.
  * Returns Z_OK upon success, Z_MEM_ERROR upon memory allocation error, and
  * Z_DATA_ERROR if the block size is invalid.
  * (zlib equivalent: inflateInit)
@@ -116,8 +313,13 @@ ZFASTEXTERN int fastlzlibDecompressInit2(zfast_stream *s, int block_size);
 
 /**
  * Set the block compressor type.
- * Returns Z_OK upon success, Z_VERSION_ERROR upon if the compressor is not
- * supported.
+ * The backend context (compression state, scratch buffers) is allocated
+ * with the first block, and kept until the stream is freed.
+ * The compressor can be changed between two blocks of a compressing stream
+ * (see OPTION_TAGGED_BLOCKS). Decompressing streams only use it for untagged
+ * blocks.
+ * Returns Z_OK upon success, and Z_VERSION_ERROR upon if the compressor is
+ * not supported.
  **/
 ZFASTEXTERN int fastlzlibSetCompressor(zfast_stream *s,
                                        zfast_stream_compressor compressor);
@@ -143,6 +345,126 @@ ZFASTEXTERN void fastlzlibSetDecompress(zfast_stream *s,
                                                           void* output,
                                                           int maxout));
 
+/**
+ * Set the block compressor function, taking an opaque context as first
+ * argument. The context is owned by the client, and is passed unchanged to
+ * each call, allowing the backend to keep persistent state (hash tables,
+ * scratch buffers..) across blocks.
+ * The corresponding decompressor should be set using fastlzlibSetDecompress2()
+ **/
+ZFASTEXTERN void fastlzlibSetCompress2(zfast_stream *s,
+                                       int (*compress)(void *ctx,
+                                                       int level,
+                                                       const void* input,
+                                                       int length,
+                                                       void* output,
+                                                       int maxout),
+                                       void *ctx);
+
+/**
+ * Set the block decompressor function, taking an opaque context as first
+ * argument.
+ * The corresponding compressor should be set using fastlzlibSetCompress2()
+ **/
+ZFASTEXTERN void fastlzlibSetDecompress2(zfast_stream *s,
+                                         int (*decompress)(void *ctx,
+                                                           const void* input,
+                                                           int length,
+                                                           void* output,
+                                                           int maxout),
+                                         void *ctx);
+
+/**
+ * Set a stream option (see zfast_stream_option).
+ * Returns Z_OK upon success, Z_STREAM_ERROR if the option or its value are
+ * invalid.
+ **/
+ZFASTEXTERN int fastlzlibSetOption(zfast_stream *s, zfast_stream_option option,
+                                   int value);
+
+/**
+ * Set the allocator of the stream memory (state, buffers, compressor contexts
+ * and dictionaries), copied from "allocator", in place of the zalloc and
+ * zfree stream members. Buffers being allocated on first need, the allocator
+ * must be set after the stream initialization, before any processing.
+ * Returns Z_OK upon success, Z_STREAM_ERROR if the stream already allocated
+ * memory, and Z_MEM_ERROR upon memory allocation error.
+ **/
+ZFASTEXTERN int fastlzlibSetAllocator(zfast_stream *s,
+                                      const zfast_allocator *allocator);
+
+/**
+ * Return the built-in allocator backing allocations of at least 2MB with
+ * transparent huge pages (aligned on huge pages, and pre-faulted upon
+ * allocation for buffers if "prefault" is non zero) on Linux, to reduce the
+ * TLB misses of large blocks, and using aligned heap memory otherwise.
+ * See also fastlzlibSetAllocator().
+ **/
+ZFASTEXTERN const zfast_allocator* fastlzlibGetHugePageAllocator(int prefault);
+
+/**
+ * Set the preset dictionary of a compressing or decompressing stream (LZ4
+ * compressor only). Only the last 64KB of the dictionary are used.
+ * A compressing stream must have its dictionary set before compressing any
+ * data ; the dictionary identifier is then recorded in the stream, and is
+ * stored in s->adler.
+ * A decompressing stream returns Z_NEED_DICT (with the required dictionary
+ * identifier in s->adler) when a dictionary is needed ; the dictionary can
+ * then be set, and decompression resumed.
+ * The dictionary is kept when the stream is reset.
+ * Returns Z_OK upon success, Z_MEM_ERROR upon memory allocation error,
+ * Z_VERSION_ERROR if the compressor does not support dictionaries,
+ * Z_DATA_ERROR if the dictionary does not match the one required by the
+ * stream, and Z_STREAM_ERROR if the stream state is inconsistent.
+ * (zlib equivalent: deflateSetDictionary, inflateSetDictionary)
+ **/
+ZFASTEXTERN int fastlzlibSetDictionary(zfast_stream *s,
+                                       const Bytef *dictionary,
+                                       uInt length);
+
+/**
+ * Create a digested preset dictionary, for compressing streams using the
+ * compression level "level" (or decompressing streams), to be attached to
+ * streams through fastlzlibAttachDictionary().
+ * The dictionary data is copied.
+ * Returns NULL upon memory allocation error, or if dictionaries are not
+ * supported.
+ **/
+ZFASTEXTERN zfast_dictionary* fastlzlibCreateDictionary(const void *dictionary,
+                                                        uInt length,
+                                                        int level);
+
+/**
+ * Free a dictionary created by fastlzlibCreateDictionary().
+ * The dictionary must not be attached to any stream anymore.
+ **/
+ZFASTEXTERN void fastlzlibFreeDictionary(zfast_dictionary *dict);
+
+/**
+ * Attach a digested dictionary to a stream, without copying nor digesting
+ * it again. Same as fastlzlibSetDictionary(), except that the dictionary is
+ * owned by the client, and must remain valid as long as the stream uses it.
+ * A NULL dictionary detaches the current one.
+ * Returns Z_OK upon success, and the same errors as fastlzlibSetDictionary().
+ **/
+ZFASTEXTERN int fastlzlibAttachDictionary(zfast_stream *s,
+                                          const zfast_dictionary *dict);
+
+/**
+ * Train a preset dictionary from "n" samples ("samples[i]" being
+ * "sizes[i]" bytes long) representative of the data to be compressed,
+ * and write it to "dictionary" ("capacity" bytes, at most 64KB are used).
+ * The dictionary is made of the most frequently repeated segments of the
+ * samples, the most useful ones being placed at the end. All available
+ * cores are used. The result can be used directly by
+ * fastlzlibSetDictionary() and fastlzlibCreateDictionary().
+ * Returns the size of the dictionary upon success, Z_MEM_ERROR upon memory
+ * allocation error, and Z_STREAM_ERROR if the arguments are invalid.
+ **/
+ZFASTEXTERN int fastlzlibTrainDictionary(const void *const *samples,
+                                         const uInt *sizes, uInt n,
+                                         void *dictionary, uInt capacity);
+
 /**
  * Free allocated data.
  * Returns Z_OK upon success.
@@ -183,6 +505,104 @@ ZFASTEXTERN int fastlzlibDecompressReset(zfast_stream *s);
  **/
 #define fastlzlibReset fastlzlibCompressReset
 
+/**
+ * Create a pool of compressing streams using the level "level", the block
+ * size "block_size" and the compressor "compressor", or of decompressing
+ * streams if "level" is ZFAST_POOL_DECOMPRESS.
+ * Released streams are kept with their buffers and backend contexts, so that
+ * acquiring a stream again does not allocate memory. Each thread keeps the
+ * streams it released for itself, without locking ; all pools share a single
+ * thread-specific data key, created upon first use.
+ * Returns NULL if the block size is invalid, or upon memory allocation
+ * error.
+ **/
+ZFASTEXTERN zfast_pool* fastlzlibPoolCreate(int level, int block_size,
+                                            zfast_stream_compressor compressor);
+
+/**
+ * Get an initialized stream from the pool "pool", ready to be used as if
+ * returned by fastlzlibCompressInit2() (or fastlzlibDecompressInit2())
+ * followed by fastlzlibSetCompressor(). The stream allocator must not be
+ * changed, and the stream must not be ended, but given back with
+ * fastlzlibPoolRelease().
+ * Returns NULL upon memory allocation error.
+ **/
+ZFASTEXTERN zfast_stream* fastlzlibPoolAcquire(zfast_pool *pool);
+
+/**
+ * Give back the stream "s" acquired from the pool "pool", at any point of
+ * its processing. The stream is reset, and its options, compressor and
+ * dictionary restored to the pool defaults.
+ **/
+ZFASTEXTERN void fastlzlibPoolRelease(zfast_pool *pool, zfast_stream *s);
+
+/**
+ * Free the pool "pool", and the streams it holds. All streams must have been
+ * released, and no other thread may use the pool anymore ; threads may exit
+ * meanwhile.
+ **/
+ZFASTEXTERN void fastlzlibPoolDestroy(zfast_pool *pool);
+
+/**
+ * Open a random-access reader of the compressed stream "data" ("length"
+ * bytes, typically a file mapped in memory, which must remain valid until
+ * the reader is closed), decompressing untagged blocks with "compressor",
+ * and using the preset dictionary "dict" if not NULL (which must remain
+ * valid as well).
+ * The block map is built once, by walking the block headers up to the EOF
+ * marker. Decoded blocks are kept in a cache of at most "cache_size" bytes
+ * (zero for the default of 64MB, and at least the largest block), split into
+ * up to 16 shards locked independently and evicting their least recently
+ * used blocks. Readers share their decoding streams, and a background thread
+ * (POSIX only) started upon the first sequential read, which decodes the
+ * next block of sequential readers ahead.
+ * Returns NULL if the stream is invalid or truncated, or upon memory
+ * allocation error.
+ **/
+ZFASTEXTERN zfast_reader* fastlzlibReaderOpen(const void *data, size_t length,
+                                              zfast_stream_compressor
+                                              compressor,
+                                              const zfast_dictionary *dict,
+                                              size_t cache_size);
+
+/**
+ * Open a random-access reader of the compressed file "fd", which is mapped
+ * in memory until the reader is closed ; the descriptor may be closed once
+ * the reader is open. See fastlzlibReaderOpen().
+ * Returns NULL if the file can not be mapped, if the stream is invalid or
+ * truncated, or upon memory allocation error.
+ **/
+ZFASTEXTERN zfast_reader* fastlzlibReaderOpenFd(int fd,
+                                                zfast_stream_compressor
+                                                compressor,
+                                                const zfast_dictionary *dict,
+                                                size_t cache_size);
+
+/**
+ * Return the uncompressed size of the stream read by "reader".
+ **/
+ZFASTEXTERN uint64_t fastlzlibReaderSize(const zfast_reader *reader);
+
+/**
+ * Read up to "len" bytes (at most 2GB - 1) of uncompressed data at the
+ * offset "offset" into "buf", decoding only the blocks covering the range
+ * that are not cached (linked blocks being decoded from the preceding
+ * keyframe). Can be called concurrently from several threads.
+ * Returns the number of bytes read (less than "len" only at the end of the
+ * stream), or the error of fastlzlibDecompress() if a block can not be
+ * decoded (Z_NEED_DICT if a preset dictionary is needed), Z_MEM_ERROR upon
+ * memory allocation error, and Z_STREAM_ERROR if the arguments are invalid.
+ * (POSIX equivalent: pread)
+ **/
+ZFASTEXTERN int fastlzlibPread(zfast_reader *reader, void *buf, uInt len,
+                               uint64_t offset);
+
+/**
+ * Close a reader opened by fastlzlibReaderOpen() or fastlzlibReaderOpenFd(),
+ * freeing its cache. No other thread may use the reader anymore.
+ **/
+ZFASTEXTERN void fastlzlibReaderClose(zfast_reader *reader);
+
 /**
  * Decompress.
  * (zlib equivalent: inflate)
@@ -209,12 +629,69 @@ ZFASTEXTERN int fastlzlibCompress(zfast_stream *s, int flush);
  * function). this flag can be used to synchronize an input compressed stream
  * to a block, and seek to a desired position without the need of decompressing
  * or reading the stream, by skipping each compressed block.
+ * when skipping blocks of a stream using linked blocks, decompression must
+ * resume on an independent block (see fastlzlibIsIndependentBlock()).
  * see also s->total_out to get the current stream position, and
  * fastlzlibGetStreamInfo() to get information on compressed blocks
  **/
 ZFASTEXTERN int fastlzlibDecompress2(zfast_stream *s, int flush,
                                      const int may_buffer);
 
+/**
+ * Decompress without copying to s->next_out: "*data" and "*len" are set to
+ * the next decompressed bytes, which can be read in place until
+ * fastlzlibDecompressConsume() is called, or the stream is used again.
+ * Blocks are decompressed in an internal buffer; stored blocks are exposed
+ * directly from the input (which must then remain valid until the block is
+ * fully consumed). The same bytes are returned until consumed. Peeking and
+ * fastlzlibDecompress() may be mixed.
+ * Returns Z_OK upon success, Z_STREAM_END when the end of stream marker is
+ * reached, Z_BUF_ERROR if more input is needed (with "*len" set to 0), or an
+ * error code.
+ **/
+ZFASTEXTERN int fastlzlibDecompressPeek(zfast_stream *s, const Bytef **data,
+                                        uInt *len);
+
+/**
+ * Mark the first "length" bytes returned by fastlzlibDecompressPeek() as
+ * processed, advancing s->total_out.
+ * Returns Z_OK upon success, and Z_STREAM_ERROR if "length" exceeds the data
+ * peeked.
+ **/
+ZFASTEXTERN int fastlzlibDecompressConsume(zfast_stream *s, uInt length);
+
+/**
+ * Load the seek index (see OPTION_INDEX) of a stream ending at the end of
+ * "data" ("length" bytes, typically the whole stream mapped in memory, or at
+ * least its trailing index) into the decompressing stream "s". The index is
+ * used in place, without being copied: "data" must remain valid as long as
+ * the stream seeks with it. The index is kept when the stream is reset.
+ * Returns the number of indexed blocks upon success, Z_BUF_ERROR if the
+ * index does not entirely lie within "data", Z_DATA_ERROR if the data does
+ * not end with a valid index, Z_VERSION_ERROR if the stream uses unsupported
+ * features, and Z_STREAM_ERROR if the arguments are invalid.
+ **/
+ZFASTEXTERN int fastlzlibLoadIndex(zfast_stream *s, const void *data,
+                                   size_t length);
+
+/**
+ * Position the decompressing stream "s" at the uncompressed offset "offset",
+ * using the index loaded by fastlzlibLoadIndex(): "*compressed_offset" is
+ * set to the offset, from the beginning of the stream, of the independent
+ * block holding the position, where the client shall resume feeding input.
+ * The stream is reset, and the data of the block preceding the position is
+ * dropped ; s->total_in and s->total_out are set to the compressed and
+ * uncompressed offsets. The content checksum is not verified anymore. The
+ * lookup is a binary search over the index entries.
+ * Returns Z_OK upon success, Z_NEED_DICT if the stream preset dictionary
+ * must be set first (with its identifier in s->adler), Z_DATA_ERROR if the
+ * dictionary set is not the one of the stream, and Z_STREAM_ERROR if no index
+ * was loaded, or if "offset" is beyond the end of the stream.
+ * (zlib equivalent: none; see gzseek)
+ **/
+ZFASTEXTERN int fastlzlibSeek(zfast_stream *s, uint64_t offset,
+                              uint64_t *compressed_offset);
+
 /**
  * Compress.
  * @arg may_buffer if non zero, accept to process partially a stream by using
@@ -229,8 +706,45 @@ ZFASTEXTERN int fastlzlibCompress2(zfast_stream *s, int flush,
                                    const int may_buffer);
 
 /**
- * Skip invalid data until a valid marker is found in the stream. All skipped
- * data will be lost, and associated uncompressed data too.
+ * Compress the "iovcnt" fragments "iov" as if they were a single contiguous
+ * input, the flush mode "flush" being applied after the last fragment.
+ * Blocks lying entirely within a fragment are compressed in place; only
+ * blocks spanning fragment boundaries are gathered in the input buffer.
+ * s->next_in and s->avail_in are ignored (and overwritten); output is written
+ * to s->next_out as usual.
+ * If the output buffer fills up before all fragments were consumed, Z_OK is
+ * returned: the consumed input size is the increase of s->total_in, and the
+ * client shall call again with the remaining fragments once more output room
+ * is available.
+ * Returns Z_STREAM_END when "flush" is Z_FINISH and the stream is complete,
+ * Z_OK upon progress, Z_BUF_ERROR if no progress was possible, and
+ * Z_STREAM_ERROR if the arguments are invalid.
+ * (zlib equivalent: none; see writev)
+ **/
+ZFASTEXTERN int fastlzlibCompressv(zfast_stream *s, const struct iovec *iov,
+                                   int iovcnt, int flush);
+
+/**
+ * Compress as much of "input" ("*length" bytes, at most the block size being
+ * used) as fits in a page of exactly "page_size" bytes written to "output",
+ * using the compression level and dictionary of the compressing stream "s",
+ * without changing its position nor its back-off state (see OPTION_PAGE_SIZE
+ * and OPTION_BACKOFF_BLOCKS).
+ * The page holds a single block followed by padding, without stream
+ * information nor EOF marker: pages can be concatenated, and decompressed
+ * with the stream dictionary, if any. "*length" is updated with the consumed
+ * input size.
+ * Returns the page size upon success, Z_STREAM_ERROR if the arguments are
+ * invalid, and Z_VERSION_ERROR if the stream compressor is not LZ4.
+ **/
+ZFASTEXTERN int fastlzlibCompressPage(zfast_stream *s, const void *input,
+                                      uInt *length, void *output,
+                                      uInt page_size);
+
+/**
+ * Skip invalid data until a valid marker of an independent block is found in
+ * the stream. All skipped data will be lost, and associated uncompressed data
+ * too.
  * Call this function after fastlzlibDecompress() returned Z_DATA_ERROR to
  * locate the next valid compressed block.
  * Returns Z_OK upon success.
@@ -258,6 +772,22 @@ ZFASTEXTERN int fastlzlibGetBlockSize(zfast_stream *s);
  **/
 ZFASTEXTERN int fastlzlibGetStreamBlockSize(const void* input, int length);
 
+/**
+ * Read the checksums of the complete block beginning with "input" ("length"
+ * bytes, header included), within a stream using the checksum flags
+ * "*flags" (ZFAST_CHECKSUM_*, zero at the start of the stream). Stream
+ * information blocks update "*flags", and hold the content checksum (XXH64,
+ * stored in "content_checksum" in canonical big endian form) at the end of
+ * the stream; other blocks hold their XXH32 ("block_checksum") if
+ * ZFAST_CHECKSUM_BLOCK is set.
+ * Returns the checksums found (ZFAST_CHECKSUM_BLOCK, ZFAST_CHECKSUM_CONTENT,
+ * or zero), Z_BUF_ERROR if the block is incomplete, Z_DATA_ERROR if it is
+ * invalid, and Z_STREAM_ERROR if arguments are invalid (NULL pointer).
+ **/
+ZFASTEXTERN int fastlzlibGetBlockChecksums(const void* input, int length,
+                                           int *flags, uInt *block_checksum,
+                                           Bytef content_checksum[8]);
+
 /**
  * Return the last error message, if any.
  * Returns NULL if no specific error message was stored.
@@ -276,6 +806,16 @@ ZFASTEXTERN int fastlzlibGetStreamInfo(const void* input, int length,
                                        uInt *compressed_size,
                                        uInt *uncompressed_size);
 
+/**
+ * Check if the block begining with "input" can be decompressed without the
+ * previous blocks.
+ * Returns Z_OK if the block is independent, Z_NEED_DICT if the block is a
+ * linked block (see OPTION_LINKED_BLOCKS) needing the previous blocks,
+ * Z_BUF_ERROR if the input data size is too small, and Z_DATA_ERROR if the
+ * stream is not a fastlz stream.
+ **/
+ZFASTEXTERN int fastlzlibIsIndependentBlock(const void* input, int length);
+
 /**
  * Check if the given data is a fastlz compressed stream.
  * Returns Z_OK is the stream is a fastlz compressed stream, Z_BUF_ERROR is the
@@ -284,14 +824,31 @@ ZFASTEXTERN int fastlzlibGetStreamInfo(const void* input, int length,
  **/
 ZFASTEXTERN int fastlzlibIsCompressedStream(const void* input, int length);
 
+/**
+ * Return an upper bound of the compressed size of "length" bytes given to the
+ * compressing stream "s" (along with its buffered input) up to a "flush"
+ * (Z_FINISH including the EOF marker), taking into account the stream
+ * information, block headers and compressor expansion ; output already
+ * pending in the stream is not included.
+ * If "s" is NULL, the bound holds for any built-in compressor used with the
+ * default block size.
+ * Returns 0 if "s" is a decompressing stream.
+ * (zlib equivalent: deflateBound)
+ **/
+ZFASTEXTERN uLong fastlzlibCompressBound(zfast_stream *s, uLong length,
+                                         int flush);
+
 /**
  * Return the internal memory buffers size.
+ * Buffers and backend contexts are allocated on first need: a stream which
+ * is idle, or always given whole blocks with enough room on output, only
+ * uses its state.
  * Returns -1 upon error.
  **/
 ZFASTEXTERN int fastlzlibCompressMemory(zfast_stream *s);
 
 /**
- * Return the internal memory buffers size.
+ * Return the internal memory buffers size (see fastlzlibCompressMemory()).
  * Returns -1 upon error.
  **/
 ZFASTEXTERN int fastlzlibDecompressMemory(zfast_stream *s);